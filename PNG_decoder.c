@@ -1,65 +1,784 @@
+// POSIX 2008 for fdopen, pread and clock_gettime, plus madvise, also under -std=c11
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include "zlib.h"
+#ifdef HAVE_ZLIB_NG
+#include <zlib-ng.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// x86 SIMD filter kernels: SSE2 is part of x86-64, AVX2 is compiled per function
+// and only used when the CPU reports it.
+#if defined(__SSE2__) || defined(_M_X64)
+#define PNG_SIMD_X86 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define PNG_SIMD_AVX2 1
+#define PNG_TARGET_AVX2 __attribute__((target("avx2")))
+#define PNG_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#define PNG_TARGET_PCLMUL __attribute__((target("pclmul")))
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define PNG_ALWAYS_INLINE __forceinline
+#else
+#define PNG_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+/* Bump allocator behind every per-image allocation, see Arena. Small
+   requests are carved out of fixed-size blocks, large ones get a block of
+   their own; nothing is freed until the whole arena is. */
+typedef struct png_arena_block
+{
+    struct png_arena_block *next; // older block
+    size_t size;                  // usable bytes after the header
+    size_t used;
+} png_arena_block_t;
+
+typedef struct png_arena
+{
+    png_arena_block_t *blocks; // shared blocks, the one being filled first
+    png_arena_block_t *large;  // one block per large allocation, newest first
+    size_t large_count;
+    void *last; // most recent allocation from blocks, the one png_arena_realloc can resize in place
+} png_arena_t;
+
+// Arena state to roll back to with png_arena_release
+typedef struct png_arena_mark
+{
+    png_arena_block_t *block;
+    size_t used;
+    size_t large_count;
+} png_arena_mark_t;
+
+// Position of one IDAT chunk's data inside decoder->data
+typedef struct IDAT_span
+{
+    size_t offset;
+    size_t size;
+} IDAT_span_t;
 
 typedef struct PNG_decoder
 {
+    png_arena_t arena; // owns the IDAT span list, the texts, a read (not mapped) input and the decode buffers
     unsigned char *data;
     size_t data_size;
     size_t offset;
-    unsigned char *idat_data;
+    IDAT_span_t *idat_spans;
     char **texts;
     unsigned int width;
     unsigned int height;
-    size_t idat_size;
+    size_t idat_size; // sum of all IDAT chunk sizes
+    size_t idat_count;
+    size_t idat_capacity;
     size_t text_count;
+    size_t filter_counts[5]; // rows per filter type, filled by the unfilter passes
+    size_t idot_first_idat;  // iDOT: file offset of the top half's first IDAT chunk
+    size_t idot_second_idat; // iDOT: file offset of the bottom half's first IDAT chunk, 0 without iDOT
+    unsigned int idot_rows[2]; // iDOT: rows in the top and bottom half
+    uint32_t *palette;         // PLTE + tRNS: 256 RGBA entries, bytes in that order in memory; NULL without PLTE
+    unsigned int palette_size; // entries in PLTE, the rest of palette is opaque black
+    unsigned char palette_alpha; // a tRNS chunk gave the palette transparency
     unsigned char bit_depth;
     unsigned char color_type;
     unsigned char compression_method;
     unsigned char filter_method;
     unsigned char interlace_method;
+    unsigned char mapped; // data is a read-only file mapping, not an arena buffer
+    unsigned char crc_failed; // a critical chunk other than IDAT failed its CRC check
+    unsigned char ihdr_invalid; // the IHDR fails check_IHDR: nothing may be decoded
 } PNG_decoder_t;
 
+// What png_probe reads from the IHDR chunk: the fields parse_IHDR fills in
+typedef struct PNG_info
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned char bit_depth;
+    unsigned char color_type;
+    unsigned char compression_method;
+    unsigned char filter_method;
+    unsigned char interlace_method;
+} PNG_info_t;
+
+// Instruction set tiers for the filter kernels, see Filter dispatch for what
+// each one overrides; only SSE2 covers every filter, the wider tiers add to it
+typedef enum PNG_isa_level
+{
+    PNG_ISA_SCALAR,
+    PNG_ISA_SSE2,
+    PNG_ISA_AVX2,
+    PNG_ISA_AVX512
+} PNG_isa_level_t;
+
+// Which chunk CRCs are checked, see CRC
+typedef enum PNG_crc_mode
+{
+    PNG_CRC_NONE,
+    PNG_CRC_CRITICAL, // IHDR, PLTE, IDAT, IEND: any chunk whose type starts with an uppercase letter
+    PNG_CRC_ALL
+} PNG_crc_mode_t;
+
+// Input and output of one inflate_backend_t feed call, advanced by it
+typedef struct inflate_io
+{
+    const unsigned char *next_in;
+    size_t avail_in;
+    unsigned char *next_out;
+    size_t avail_out;
+    // Backends with reads_spans: when spans is set the input is these pieces of span_base, not next_in
+    const unsigned char *span_base;
+    const IDAT_span_t *spans;
+    size_t span_count;
+} inflate_io_t;
+
+// feed results
+#define INFLATE_ERROR -1
+#define INFLATE_MORE 0 // the stream goes on: needs more input or more room
+#define INFLATE_END 1  // end of stream reached, trailer checked
+
+// Decompression library behind the decode paths, see Inflate backends
+typedef struct inflate_backend
+{
+    const char *name;
+    int whole_buffer; // feed needs the complete stream and the complete output in one call
+    int reads_spans;  // whole_buffer only: the stream may come as the IDAT spans (io->spans) instead of one buffer
+    void *(*init)(int raw, png_arena_t *arena); // raw: DEFLATE without zlib header and trailer; the state lives in arena
+    int (*feed)(void *state, inflate_io_t *io);
+    int (*reset)(void *state);
+    void (*finish)(void *state); // releases what the state holds outside its arena
+} inflate_backend_t;
+
+// Tables and bit buffer of the builtin decoder, see Inflate
+typedef struct inflate_state inflate_state_t;
+
+// One stream being inflated: what the decode loops hold instead of a z_stream
+typedef struct inflater
+{
+    const inflate_backend_t *backend;
+    void *state;
+    inflate_io_t io;
+    int status; // last feed result
+} inflater_t;
+
+// Filtered scanlines in order, from whichever backend is active, see Row range
+typedef struct scanline_source
+{
+    unsigned char *inflated; // whole-buffer backends: the complete filtered stream
+    unsigned char *scanline; // the others: the row being inflated
+    size_t scanline_size;
+    size_t span_index;
+    inflater_t inflater;
+} scanline_source_t;
+
+// 1, 2 or 4-bit samples to bytes, one lookup per packed byte, see Unpack
+typedef struct sample_unpacker
+{
+    unsigned char lut[256][8]; // the 8 / bit_depth samples of each byte value, leftmost first
+    unsigned int bit_depth;
+} sample_unpacker_t;
+
+// Called by walk_rows with each row as soon as it is reconstructed, see Row range
+typedef void (*row_sink_fn_t)(void *context, const unsigned char *row, size_t y);
+
+// Per-row state of decode_thumbnail, see Thumbnail
+typedef struct thumbnail_sink
+{
+    uint32_t *column_sums;
+    size_t samples;            // per row
+    size_t sample_size;
+    size_t channels;
+    size_t width;
+    size_t height;
+    unsigned int scale_shift;
+    unsigned char *thumb_row;  // next thumbnail row to write
+    size_t thumb_row_size;
+    const sample_unpacker_t *unpacker; // 1, 2 or 4-bit gray only
+    unsigned char *unpacked;
+} thumbnail_sink_t;
+
+// Per-row state of decode_palette_expanded, see Palette
+typedef struct palette_sink
+{
+    PNG_decoder_t *decoder;
+    unsigned char *output;
+    size_t output_row_size;
+    const sample_unpacker_t *unpacker; // 1, 2 or 4-bit indices only
+    unsigned char *unpacked;
+} palette_sink_t;
+
+// Per-row state of decode_unpacked, see Unpack
+typedef struct unpack_sink
+{
+    const sample_unpacker_t *unpacker;
+    unsigned char *output;
+    size_t width;
+} unpack_sink_t;
+
+// Rows of the filter dispatch table: the five PNG filter types, plus Average
+// on a row without a previous scanline
+enum
+{
+    FILTER_KERNEL_NONE,
+    FILTER_KERNEL_SUB,
+    FILTER_KERNEL_UP,
+    FILTER_KERNEL_AVERAGE,
+    FILTER_KERNEL_PAETH,
+    FILTER_KERNEL_AVERAGE_FIRST_ROW,
+    FILTER_KERNEL_COUNT
+};
+// Minimal thread layer: pthreads, or the Win32 equivalents
+#ifdef _WIN32
+typedef HANDLE png_thread_t;
+typedef CRITICAL_SECTION png_mutex_t;
+typedef INIT_ONCE png_once_t;
+#define PNG_ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+typedef pthread_t png_thread_t;
+typedef pthread_mutex_t png_mutex_t;
+typedef pthread_once_t png_once_t;
+#define PNG_ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+typedef void *(*png_thread_fn_t)(void *arg);
+
+// Scanline ring between the inflate and unfilter threads, see Pipeline
+typedef struct scanline_ring
+{
+    PNG_decoder_t *decoder;
+    unsigned char *slots;
+    size_t slot_size;     // stride between slots, a whole number of cache lines
+    size_t slot_count;
+    size_t scanline_size; // filter byte + row
+    // Each counter has a single writer; they sit on their own cache lines so
+    // the two threads do not bounce one line back and forth on every row.
+    _Alignas(64) atomic_size_t produced; // rows inflated, written by the inflate thread
+    _Alignas(64) atomic_size_t consumed; // rows unfiltered, written by the unfilter thread
+    _Alignas(64) atomic_int failed;      // set by either side to stop the other
+} scanline_ring_t;
+
+// CRC check of the IDAT chunks, run next to inflate, see CRC
+typedef struct IDAT_crc_check
+{
+    PNG_decoder_t *decoder;
+    png_thread_t thread;
+    int threaded; // thread is running and has to be joined
+    int status;   // 0 once every IDAT chunk matched its CRC
+} IDAT_crc_check_t;
+
+// One of the seven sub-images of an Adam7 image, see Adam7
+typedef struct adam7_pass
+{
+    unsigned char *data; // filtered rows in the inflated stream, unfiltered in place (then row_size apart)
+    size_t offset;       // of data in the inflated stream
+    size_t width;        // pixels
+    size_t height;
+    size_t row_size;     // bytes of one unfiltered row
+    size_t filter_counts[5];
+} adam7_pass_t;
+
+// Share of one Adam7 thread: a run of passes to unfilter, then a band of rows to deinterlace
+typedef struct adam7_job
+{
+    adam7_pass_t *passes;
+    size_t first_pass;
+    size_t end_pass;
+    size_t bytes_per_pixel;
+    unsigned int bit_depth; // below 8: pixels are packed, bytes_per_pixel is 1
+    unsigned char *output;
+    size_t row_size;
+    size_t first_row;
+    size_t end_row;
+    int status;
+} adam7_job_t;
+
+// One independently inflatable part of an iDOT image, see Split IDAT
+typedef struct IDAT_segment
+{
+    PNG_decoder_t view;       // copy of the decoder whose IDAT spans cover only this segment, with an arena of its own
+    unsigned char *output;    // first output row of the segment
+    unsigned char *deferred;  // filtered rows, kept when the first row depends on the previous segment
+    size_t first_row;
+    size_t rows;
+    uLong adler;              // adler32 of this segment's inflated bytes
+    unsigned char trailer[4]; // last segment: the stream's adler32
+    int raw;                  // no zlib header: the segment continues the previous one
+    int status;
+} IDAT_segment_t;
+
+// Long-lived decoder for many images in a row, see Decoder context
+typedef struct PNG_decoder_context
+{
+    PNG_decoder_t decoder; // the current image; its arena is emptied, not freed, between images
+    inflater_t inflater;   // reset between images instead of being set up again
+    png_arena_t arena;     // the inflater's state, which outlives the images
+    unsigned char *image;  // output of the last decode
+    size_t image_capacity;
+    unsigned char *scanline;
+    size_t scanline_capacity;
+} PNG_decoder_context_t;
+
+// Batch decoding, see Batch
+typedef struct batch_task
+{
+    const char *path;
+    uint64_t cost; // estimated filtered stream size in bytes, 0 if the header could not be read
+} batch_task_t;
+
+typedef struct batch_deque
+{
+    batch_task_t *tasks; // slice of batch_job_t.tasks, largest first
+    size_t head;         // next task to take
+    size_t tail;         // one past the last task
+    png_mutex_t lock;
+} batch_deque_t;
+
+typedef struct batch_job
+{
+    batch_task_t *tasks;
+    batch_deque_t *deques;
+    size_t worker_count;
+    png_mutex_t lock;
+    // totals, guarded by lock
+    size_t files_ok;
+    size_t files_failed;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+} batch_job_t;
+
+typedef struct batch_worker_arg
+{
+    batch_job_t *job;
+    size_t index; // this worker's deque
+} batch_worker_arg_t;
+
+typedef void (*unfilter_fn_t)(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+
 #pragma region Declarations
 int initialize_decoder(PNG_decoder_t *decoder, const char *filename);
+int load_input(PNG_decoder_t *decoder, const char *filename);
+int read_input_stream(PNG_decoder_t *decoder, FILE *file);
+void release_input(PNG_decoder_t *decoder);
 
 void parse_chunks(PNG_decoder_t *decoder);
 void parse_IHDR(PNG_decoder_t *decoder, unsigned char *chunk_data);
+int valid_bit_depth(unsigned int color_type, unsigned int bit_depth);
+int check_IHDR(const PNG_decoder_t *decoder);
 void parse_IDAT(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size);
 void parse_tEXt(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size);
+void parse_PLTE(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size);
+void parse_tRNS(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size);
+void parse_iDOT(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size);
 uint32_t to_big_endian(uint8_t *bytes);
 void print_PNG_info(PNG_decoder_t *decoder);
+int png_probe(const char *path, PNG_info_t *info);
+int png_probe_mem(const unsigned char *buffer, size_t size, PNG_info_t *info);
+void init_crc32(void);
+uint32_t crc32_slice8(uint32_t crc, const unsigned char *data, size_t size);
+#if PNG_SIMD_AVX2
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char *data, size_t size);
+#endif
+uint32_t png_crc32(uint32_t crc, const unsigned char *data, size_t size);
+extern const char *crc_mode_names[];
+int parse_crc_mode(const char *name, PNG_crc_mode_t *mode);
+void png_set_crc_mode(PNG_crc_mode_t mode);
+PNG_crc_mode_t png_get_crc_mode(void);
+int check_chunk_crc(const unsigned char *chunk_type, size_t chunk_size);
+void *verify_IDAT_crc(void *arg);
+int IDAT_crc_begin(PNG_decoder_t *decoder, IDAT_crc_check_t *check);
+int IDAT_crc_end(IDAT_crc_check_t *check);
+int next_IDAT_input(PNG_decoder_t *decoder, inflate_io_t *io, size_t *span_index);
 int decompress_IDAT(PNG_decoder_t *decoder, unsigned char **out_data, size_t *out_size);
+int inflate_IDAT(PNG_decoder_t *decoder, inflater_t *inflater, unsigned char *out_data, size_t buffer_size, size_t *out_size);
+int build_decode_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count, const uint32_t *symbol_entries, unsigned int table_bits, int allow_incomplete);
+void pair_literals(uint32_t *table);
+int build_litlen_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count);
+int build_distance_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count);
+int builtin_inflate(inflate_state_t *s, unsigned char *out, size_t out_size, size_t *out_written);
+uint32_t builtin_adler32(const unsigned char *data, size_t size);
+int builtin_zlib_decompress(inflate_state_t *s, unsigned char *out, size_t out_size, size_t *out_written);
+extern const inflate_backend_t *inflate_backends[];
+const inflate_backend_t *find_inflate_backend(const char *name);
+void init_inflate_backend(void);
+int png_set_inflate_backend(const char *name);
+const inflate_backend_t *png_get_inflate_backend(void);
+int inflater_init(inflater_t *inflater, const inflate_backend_t *backend, int raw, png_arena_t *arena);
+void inflater_end(inflater_t *inflater);
+const unsigned char *join_IDAT(PNG_decoder_t *decoder);
 unsigned char *apply_filters(PNG_decoder_t *decoder, unsigned char *decompressed_data);
-void no_filter(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width);
-void sub_filter(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width);
+unsigned char *apply_filters_in_place(PNG_decoder_t *decoder, unsigned char *decompressed_data, int compact);
+int unfilter_image(PNG_decoder_t *decoder, unsigned char *decompressed_data, unsigned char *output, size_t bytes_per_pixel);
+int unfilter_rows(const unfilter_fn_t *kernels, unsigned char *filtered, unsigned char *output, size_t bytes_per_pixel, size_t row_size, size_t height, size_t filter_counts[5]);
+int decode_streaming(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size);
+int inflate_and_unfilter(PNG_decoder_t *decoder, inflater_t *inflater, unsigned char *output, unsigned char *scanline);
+int inflate_scanline(PNG_decoder_t *decoder, inflater_t *inflater, size_t *span_index, unsigned char *scanline, size_t scanline_size);
+int finish_IDAT_stream(PNG_decoder_t *decoder, inflater_t *inflater, size_t *span_index);
+int decode_row_range(PNG_decoder_t *decoder, size_t first_row, size_t row_count, unsigned char **out_image, size_t *out_size);
+int walk_rows(PNG_decoder_t *decoder, size_t bytes_per_pixel, size_t end_row, unsigned char *output, size_t first_output_row, row_sink_fn_t sink, void *context);
+int scanline_source_open(PNG_decoder_t *decoder, scanline_source_t *source, size_t scanline_size);
+unsigned char *scanline_source_next(PNG_decoder_t *decoder, scanline_source_t *source, size_t y);
+int scanline_source_finish(PNG_decoder_t *decoder, scanline_source_t *source);
+void scanline_source_close(scanline_source_t *source);
+int decode_thumbnail(PNG_decoder_t *decoder, unsigned int scale_shift, unsigned char **out_image, size_t *out_size, unsigned int *out_width, unsigned int *out_height);
+void add_thumbnail_row(void *context, const unsigned char *row, size_t y);
+void accumulate_thumbnail_row(uint32_t *column_sums, const unsigned char *row, size_t samples, size_t sample_size);
+void write_thumbnail_row(unsigned char *output, uint32_t *column_sums, size_t width, unsigned int block_rows, size_t channels, size_t sample_size, unsigned int scale_shift);
+int decode_unpacked(PNG_decoder_t *decoder, int scale, unsigned char **out_image, size_t *out_size);
+void unpack_output_row(void *context, const unsigned char *row, size_t y);
+int is_packed_bit_depth(unsigned int bit_depth);
+void init_sample_unpacker(sample_unpacker_t *unpacker, unsigned int bit_depth, int scale);
+void unpack_samples(const sample_unpacker_t *unpacker, const unsigned char *packed, unsigned char *output, size_t width);
+int decode_palette_expanded(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size);
+void expand_indexed_row(void *context, const unsigned char *row, size_t y);
+void expand_palette_row(PNG_decoder_t *decoder, const unsigned char *indices, unsigned char *output);
+void expand_palette_scalar(const uint32_t *palette, const unsigned char *indices, unsigned char *output, size_t width, int alpha);
+#if PNG_SIMD_AVX2
+void expand_palette_avx2(const uint32_t *palette, unsigned int palette_size, const unsigned char *indices, unsigned char *output, size_t width, int alpha);
+#endif
+int decode_pipelined(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size);
+void *inflate_rows(void *arg);
+int split_IDAT_segments(PNG_decoder_t *decoder, IDAT_segment_t segments[2]);
+void *decode_IDAT_segment(void *arg);
+int decode_split_IDAT(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size);
+size_t locate_adam7_passes(PNG_decoder_t *decoder, size_t bytes_per_pixel, adam7_pass_t passes[7]);
+int decode_interlaced(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size);
+int run_adam7_jobs(adam7_job_t jobs[2], png_thread_fn_t fn, int parallel);
+void *unfilter_adam7_passes(void *arg);
+void *deinterlace_adam7_rows(void *arg);
+int decode_adam7_preview(PNG_decoder_t *decoder, int pass_count, int upscale, unsigned char **out_image, size_t *out_size, unsigned int *out_width, unsigned int *out_height);
+void scatter_pixels(unsigned char *output, const unsigned char *pixels, size_t count, size_t x_start, size_t x_step, size_t bytes_per_pixel);
+void scatter_packed_pixels(unsigned char *output, const unsigned char *pixels, size_t count, size_t x_start, size_t x_step, unsigned int bit_depth);
+void interleave_pixels(unsigned char *output, const unsigned char *even, size_t even_count, const unsigned char *odd, size_t odd_count, size_t bytes_per_pixel);
+size_t get_bytes_per_pixel(PNG_decoder_t *decoder);
+size_t get_row_size(PNG_decoder_t *decoder, size_t bytes_per_pixel);
+size_t get_packed_row_size(size_t width, unsigned int bit_depth, size_t bytes_per_pixel);
+const unfilter_fn_t *select_filter_kernels(size_t bytes_per_pixel);
+int unfilter_scanline(const unfilter_fn_t *kernels, unsigned char filter_type, unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t row_size);
+void print_filter_counts(size_t filter_counts[5]);
+void no_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter_from(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t start, size_t size);
 void up_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
 void average_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void average_filter_first_row(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
 unsigned char paeth_predictor(unsigned char left, unsigned char up, unsigned char upper_left);
 void paeth_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+#if PNG_SIMD_X86
+void sub_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void up_filter_sse2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void average_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void average_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void average_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void average_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void paeth_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void paeth_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void paeth_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void paeth_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+#if PNG_SIMD_AVX2
+void sub_filter_avx2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void sub_filter_avx2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void up_filter_avx2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+void up_filter_avx512(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width);
+#endif
+#endif
+extern unfilter_fn_t filter_kernels[9][FILTER_KERNEL_COUNT];
+extern const char *isa_level_names[];
+extern const char *isa_level_coverage[];
+PNG_isa_level_t detect_isa_level(void);
+void fill_filter_table(PNG_isa_level_t level);
+int parse_isa_level(const char *name, PNG_isa_level_t *level);
+void init_filter_dispatch(void);
+int check_isa_level(PNG_isa_level_t level);
+int png_set_isa_level(PNG_isa_level_t level);
+PNG_isa_level_t png_get_isa_level(void);
+
+int png_thread_create(png_thread_t *thread, png_thread_fn_t fn, void *arg);
+void png_thread_join(png_thread_t thread);
+void png_mutex_init(png_mutex_t *mutex);
+void png_mutex_lock(png_mutex_t *mutex);
+void png_mutex_unlock(png_mutex_t *mutex);
+void png_mutex_destroy(png_mutex_t *mutex);
+void png_call_once(png_once_t *once, void (*fn)(void));
+void png_yield(void);
+size_t cpu_count(void);
+double now_seconds(void);
+
+void png_arena_init(png_arena_t *arena);
+void *png_arena_alloc(png_arena_t *arena, size_t size);
+void *png_arena_realloc(png_arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+png_arena_mark_t png_arena_mark(png_arena_t *arena);
+void png_arena_release(png_arena_t *arena, png_arena_mark_t mark);
+void png_arena_reset(png_arena_t *arena);
+void png_arena_free(png_arena_t *arena);
+void *png_arena_zalloc(void *opaque, unsigned int items, unsigned int size);
+void png_arena_zfree(void *opaque, void *address);
+
+void png_decoder_context_init(PNG_decoder_context_t *context);
+void png_decoder_reset(PNG_decoder_context_t *context);
+void png_decoder_context_free(PNG_decoder_context_t *context);
+int reserve_buffer(unsigned char **buffer, size_t *capacity, size_t size);
+int png_decoder_decode_next(PNG_decoder_context_t *context, const char *filename, const unsigned char **out_image, size_t *out_size);
+
+int decode_file(PNG_decoder_context_t *context, const char *path, size_t *input_size, size_t *output_size, unsigned int *width, unsigned int *height);
+uint64_t estimate_decode_cost(const char *path);
+int compare_task_cost(const void *a, const void *b);
+int batch_next_task(batch_job_t *job, size_t index, batch_task_t *task);
+void *batch_worker(void *arg);
+int add_path(char ***paths, size_t *path_count, size_t *path_capacity, const char *path);
+int read_path_list(const char *list_name, char ***paths, size_t *path_count, size_t *path_capacity);
+int run_batch(char **paths, size_t path_count, size_t thread_count);
 
 #pragma endregion
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    const char *filename = NULL;
+    int whole_image = 0; // --whole: inflate everything first, then unfilter
+    int in_place = 0;    // --in-place: like --whole, but unfilter over the inflated buffer
+    int pipelined = 0;   // --pipeline: inflate and unfilter on two threads
+    int row_range = 0;   // --rows FIRST-LAST: decode only that band of rows
+    size_t first_row = 0;
+    size_t last_row = 0;
+    unsigned int thumbnail_shift = 0; // --thumbnail 2|4|8: decode at 1/2, 1/4 or 1/8 scale
+    int preview_passes = 0; // --preview N: Adam7 images, only the first N passes
+    int upscale = 0;        // --upscale: the preview at full size instead of its own grid
+    int expand = 0;         // --expand: palette images as RGB(A) instead of indices
+    int unpack = 0;         // --unpack: 1, 2 and 4-bit samples as one byte each, gray scaled to 0-255
+    int batch = 0;       // --batch: decode every listed file on a pool of worker threads
+    int probe = 0;       // --probe: print the header of every listed file, decode nothing
+    size_t thread_count = 0; // --threads N, 0: one per CPU
+    const char *list_name = NULL; // --list FILE: batch paths, one per line ("-": stdin)
+    char **paths = NULL;
+    size_t path_count = 0;
+    size_t path_capacity = 0;
+
+    init_filter_dispatch(); // probe the CPU once, before any decoding
+    init_inflate_backend();
+    init_crc32();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = 1;
+        }
+        else if (strcmp(argv[i], "--probe") == 0)
+        {
+            probe = 1;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            thread_count = (size_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--list") == 0 && i + 1 < argc)
+        {
+            batch = 1;
+            list_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--inflate") == 0 && i + 1 < argc)
+        {
+            if (png_set_inflate_backend(argv[++i]) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0)
+        {
+            pipelined = 1;
+        }
+        else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%zu-%zu", &first_row, &last_row) != 2 || last_row < first_row)
+            {
+                fprintf(stderr, "Invalid row range: %s (expected FIRST-LAST)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            row_range = 1;
+        }
+        else if (strcmp(argv[i], "--thumbnail") == 0 && i + 1 < argc)
+        {
+            unsigned long scale = strtoul(argv[++i], NULL, 10);
+            thumbnail_shift = scale == 2 ? 1 : scale == 4 ? 2 : scale == 8 ? 3 : 0;
+            if (thumbnail_shift == 0)
+            {
+                fprintf(stderr, "Invalid thumbnail scale: %s (expected 2, 4 or 8)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+        {
+            preview_passes = atoi(argv[++i]);
+            if (preview_passes < 1 || preview_passes > 7)
+            {
+                fprintf(stderr, "Invalid preview pass count: %s (expected 1 to 7)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--upscale") == 0)
+        {
+            upscale = 1;
+        }
+        else if (strcmp(argv[i], "--expand") == 0)
+        {
+            expand = 1;
+        }
+        else if (strcmp(argv[i], "--unpack") == 0)
+        {
+            unpack = 1;
+        }
+        else if (strcmp(argv[i], "--whole") == 0)
+        {
+            whole_image = 1;
+        }
+        else if (strcmp(argv[i], "--in-place") == 0)
+        {
+            whole_image = 1;
+            in_place = 1;
+        }
+        else if (strcmp(argv[i], "--crc") == 0 && i + 1 < argc)
+        {
+            PNG_crc_mode_t mode;
+            if (parse_crc_mode(argv[++i], &mode) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            png_set_crc_mode(mode);
+        }
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            PNG_isa_level_t level;
+            if (parse_isa_level(argv[++i], &level) != 0 || png_set_isa_level(level) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (add_path(&paths, &path_count, &path_capacity, argv[i]) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (probe)
+    {
+        int failed = path_count == 0;
+        for (size_t i = 0; i < path_count; i++)
+        {
+            PNG_info_t info;
+            if (png_probe(paths[i], &info) != 0)
+            {
+                printf("FAIL %s\n", paths[i]);
+                failed = 1;
+            }
+            else
+            {
+                printf("OK   %s %ux%u depth %u color %u%s\n", paths[i], info.width, info.height, info.bit_depth, info.color_type,
+                       info.interlace_method ? " interlaced" : "");
+            }
+            free(paths[i]);
+        }
+        free(paths);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (batch)
     {
-        fprintf(stderr, "Usage: %s <filename.png>\n", argv[0]);
+        int ret = -1;
+        if (!list_name || read_path_list(list_name, &paths, &path_count, &path_capacity) == 0)
+        {
+            ret = path_count ? run_batch(paths, path_count, thread_count) : -1;
+        }
+        if (path_count == 0)
+        {
+            fprintf(stderr, "No files to decode.\n");
+        }
+        for (size_t i = 0; i < path_count; i++)
+        {
+            free(paths[i]);
+        }
+        free(paths);
+        return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (path_count == 1)
+    {
+        filename = paths[0];
+    }
+    if (!filename)
+    {
+        fprintf(stderr, "Usage: %s [--whole | --in-place | --pipeline | --rows FIRST-LAST | --thumbnail 2|4|8 | --preview 1-7 [--upscale] | --expand | --unpack] [--isa scalar|sse2|avx2|avx512] [--inflate zlib|zlib-ng|libdeflate|builtin] [--crc none|critical|all] <filename.png | ->\n"
+                        "       %s --batch [--threads N] [--crc none|critical|all] [--list FILE | -] [files...]\n"
+                        "       %s --probe files...\n",
+                argv[0], argv[0], argv[0]);
+        for (size_t i = 0; i < path_count; i++)
+        {
+            free(paths[i]);
+        }
+        free(paths);
         return EXIT_FAILURE;
     }
-    const char *filename = argv[1];
 
     PNG_decoder_t decoder;
+    png_arena_init(&decoder.arena); // initialize_decoder resets everything but the arena
     if (initialize_decoder(&decoder, filename) != 0)
     {
         fprintf(stderr, "Failed to initialize PNG decoder.\n");
+        png_arena_free(&decoder.arena);
+        free(paths[0]);
+        free(paths);
         return EXIT_FAILURE;
     }
 
     parse_chunks(&decoder);
 
+    // Joined in cleanup at the latest: the CRC thread reads the input until then
+    IDAT_crc_check_t crc_check;
+    memset(&crc_check, 0, sizeof(crc_check));
+    unsigned char *decompressed_data = NULL;
+    unsigned char *filtered_data = NULL;
+    int status = EXIT_SUCCESS;
+
+    if (decoder.crc_failed)
+    {
+        fprintf(stderr, "Corrupt PNG file (chunk CRC mismatch).\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
+    }
+    if (decoder.ihdr_invalid)
+    {
+        fprintf(stderr, "Corrupt PNG file (invalid IHDR).\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
+    }
+
     // INFO
     print_PNG_info(&decoder);
     printf("\nText Data:\n");
@@ -68,135 +787,436 @@ int main(int argc, char *argv[])
         printf("Text[%zu]: %s\n", i, decoder.texts[i]);
     }
     printf("\nIDAT Data Size: %zu bytes\n", decoder.idat_size);
+    printf("Filter kernels: %s (%s)\n", isa_level_names[png_get_isa_level()], isa_level_coverage[png_get_isa_level()]);
+    printf("Inflate: %s\n", png_get_inflate_backend()->name);
+    printf("CRC check: %s\n", crc_mode_names[png_get_crc_mode()]);
 
-    // Decompression
-    unsigned char *decompressed_data = NULL;
-    size_t decompressed_size = 0;
+    // Large IDAT data is checked on another thread while it is inflated
+    if (IDAT_crc_begin(&decoder, &crc_check) != 0)
+    {
+        fprintf(stderr, "Corrupt PNG file (IDAT CRC mismatch).\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
+    }
 
-    if (decompress_IDAT(&decoder, &decompressed_data, &decompressed_size) != 0)
+    if (preview_passes)
     {
-        fprintf(stderr, "Failed to decompress IDAT data.\n");
-        free(decoder.data);
-        free(decoder.idat_data);
-        for (size_t i = 0; i < decoder.text_count; i++)
+        // Adam7: stop inflating once the first passes are in
+        size_t image_size = 0;
+        unsigned int preview_width = 0;
+        unsigned int preview_height = 0;
+
+        if (decode_adam7_preview(&decoder, preview_passes, upscale, &filtered_data, &image_size, &preview_width, &preview_height) != 0)
         {
-            free(decoder.texts[i]);
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
         }
-        free(decoder.texts);
-        return EXIT_FAILURE;
+
+        printf("\nPreview: %d of 7 passes, %ux%u, %zu bytes\n", preview_passes, preview_width, preview_height, image_size);
+    }
+    else if (expand)
+    {
+        // Palette lookups fused with unfiltering
+        size_t image_size = 0;
+
+        if (decode_palette_expanded(&decoder, &filtered_data, &image_size) != 0)
+        {
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        printf("\nExpanded: %u-entry palette to %s, %zu bytes\n", decoder.palette_size, decoder.palette_alpha ? "RGBA" : "RGB", image_size);
     }
+    else if (unpack)
+    {
+        // Packed samples widened to bytes as each row is unfiltered
+        size_t image_size = 0;
+
+        if (decode_unpacked(&decoder, 1, &filtered_data, &image_size) != 0)
+        {
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
 
-    printf("\nDecompressed Data Size: %zu bytes\n", decompressed_size);
+        printf("\nUnpacked: %u-bit samples to 8 bits, %zu bytes\n", decoder.bit_depth, image_size);
+    }
+    else if (thumbnail_shift)
+    {
+        // Downscale while unfiltering, the full-size image never exists
+        size_t image_size = 0;
+        unsigned int thumb_width = 0;
+        unsigned int thumb_height = 0;
 
+        if (decode_thumbnail(&decoder, thumbnail_shift, &filtered_data, &image_size, &thumb_width, &thumb_height) != 0)
+        {
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
 
-    // Apply filters
-    unsigned char *filtered_data = apply_filters(&decoder, decompressed_data);
-    if (!filtered_data)
+        printf("\nThumbnail: %ux%u, %zu bytes\n", thumb_width, thumb_height, image_size);
+    }
+    else if (row_range)
     {
-        fprintf(stderr, "Failed to apply filters.\n");
-        // free(decompressed_data);
-        return EXIT_FAILURE;
+        // Inflate only as far as the last requested row
+        size_t image_size = 0;
+
+        if (decode_row_range(&decoder, first_row, last_row - first_row + 1, &filtered_data, &image_size) != 0)
+        {
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        printf("\nImage Data Size: %zu bytes (rows %zu-%zu)\n", image_size, first_row, last_row);
     }
+    else if (whole_image && decoder.interlace_method != 1) // Adam7 images only decode as a whole
+    {
+        // Decompression
+        size_t decompressed_size = 0;
 
-    // FREE
-    free(decompressed_data);
-    free(decoder.data);
-    free(decoder.idat_data);
-    for (size_t i = 0; i < decoder.text_count; i++)
+        if (decompress_IDAT(&decoder, &decompressed_data, &decompressed_size) != 0)
+        {
+            fprintf(stderr, "Failed to decompress IDAT data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        printf("\nDecompressed Data Size: %zu bytes\n", decompressed_size);
+
+        // A short stream would leave the last rows unfiltered over uninitialized bytes
+        size_t stream_size = (get_row_size(&decoder, get_bytes_per_pixel(&decoder)) + 1) * decoder.height;
+        if (decompressed_size != stream_size)
+        {
+            fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", decompressed_size, stream_size);
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        // Apply filters
+        if (in_place)
+        {
+            // The image is a view into decompressed_data, which is compacted to the image size
+            unsigned char *image = apply_filters_in_place(&decoder, decompressed_data, 1);
+            if (!image)
+            {
+                fprintf(stderr, "Failed to apply filters.\n");
+                status = EXIT_FAILURE;
+                goto cleanup;
+            }
+            decompressed_data = image;
+        }
+        else
+        {
+            filtered_data = apply_filters(&decoder, decompressed_data);
+            if (!filtered_data)
+            {
+                fprintf(stderr, "Failed to apply filters.\n");
+                status = EXIT_FAILURE;
+                goto cleanup;
+            }
+        }
+    }
+    else
+    {
+        // Inflate and unfilter one scanline at a time, optionally on two threads
+        size_t image_size = 0;
+
+        // decode_split_IDAT is decode_streaming unless the image has a usable iDOT chunk
+        int ret = pipelined ? decode_pipelined(&decoder, &filtered_data, &image_size)
+                            : decode_split_IDAT(&decoder, &filtered_data, &image_size);
+        if (ret != 0)
+        {
+            fprintf(stderr, "Failed to decode image data.\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        printf("\nImage Data Size: %zu bytes\n", image_size);
+    }
+    if (IDAT_crc_end(&crc_check) != 0)
     {
-        free(decoder.texts[i]);
+        fprintf(stderr, "Corrupt PNG file (IDAT CRC mismatch).\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
     }
-    free(decoder.texts);
+    print_filter_counts(decoder.filter_counts);
+
+cleanup:
+    IDAT_crc_end(&crc_check); // before the input goes away
+    // FREE: the texts, the IDAT spans and both buffers all live in the arena
+    release_input(&decoder);
+    png_arena_free(&decoder.arena);
+    free(paths[0]);
+    free(paths);
 
-    return EXIT_SUCCESS;
+    return status;
 }
 
 #pragma region Definitions
 int initialize_decoder(PNG_decoder_t *decoder, const char *filename)
 {
-    FILE *file;
-    if (fopen_s(&file, filename, "rb") != 0)
-    {
-        perror("Failed to open file");
-        return -1;
-    }
+    init_filter_dispatch(); // no-op after the first call
+    init_inflate_backend();
+    init_crc32();
 
-    fseek(file, 0, SEEK_END);         // pointer at the end of the file for the size
-    decoder->data_size = ftell(file); // get size
-    if (decoder->data_size == -1)
-    {
-        perror("Failed to determine file size");
-        fclose(file);
-        return -1;
-    }
-    fseek(file, 0, SEEK_SET); // pointer at the start of the file
+    // Chunks that never show up (no IHDR, no tEXt) leave their fields at zero.
+    // The arena is the caller's: it may still hold blocks from a previous image.
+    png_arena_t arena = decoder->arena;
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->arena = arena;
 
-    // Read Data
-    decoder->data = (unsigned char *)malloc(decoder->data_size);
-    if (!decoder->data)
+    if (load_input(decoder, filename) != 0)
     {
-        fclose(file);
         return -1;
     }
-    fread(decoder->data, 1, decoder->data_size, file);
-    // Read the entire file into memory for efficient processing of PNG chunks
-    // This approach is suitable because PNG files are typically small.
-    fclose(file);
 
     // PNG signature "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"
-    if (memcmp(decoder->data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
+    if (decoder->data_size < 8 || memcmp(decoder->data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
     {
         fprintf(stderr, "Invalid PNG file!\n");
-        free(decoder->data);
+        release_input(decoder);
         return -1;
     }
+#ifndef _WIN32
+    // Only now that it is a PNG: let the kernel read ahead the rest of the file
+    if (decoder->mapped)
+    {
+        madvise(decoder->data, decoder->data_size, MADV_SEQUENTIAL);
+    }
+#endif
 
     decoder->offset = 8; // Skip PNG signature "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"
-    decoder->idat_data = NULL;
-    decoder->idat_size = 0;
-    decoder->texts = NULL;
-    decoder->text_count = 0;
 
     return 0;
 }
-void parse_chunks(PNG_decoder_t *decoder)
+/* Regular files are memory-mapped read-only instead of being copied into a
+   buffer: parse_chunks and the IDAT spans work directly on the
+   mapped pages, the page cache is shared between processes decoding the same
+   file, and rejecting a non-PNG only touches the first page.
+   Pipes, character devices and "-" (stdin) cannot be mapped and are read
+   into memory with read_input_stream instead. */
+#ifdef _WIN32
+int load_input(PNG_decoder_t *decoder, const char *filename)
 {
-    while (decoder->offset < decoder->data_size)
+    FILE *file;
+    if (strcmp(filename, "-") == 0)
     {
-        // GOTO line 478 for explanation
-        uint32_t chunk_size = to_big_endian(decoder->data + decoder->offset);
-        decoder->offset += 4;
-
-        // chunk type
-        unsigned char *chunk_type = decoder->data + decoder->offset;
-        decoder->offset += 4;
-
-        // chunck data
-        unsigned char *chunk_data = decoder->data + decoder->offset;
-        decoder->offset += chunk_size;
+        _setmode(_fileno(stdin), _O_BINARY);
+        return read_input_stream(decoder, stdin);
+    }
 
-        // CRC
-        decoder->offset += 4;
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Failed to open file: %s (error %lu)\n", filename, GetLastError());
+        return -1;
+    }
 
-        if (memcmp(chunk_type, "IHDR", 4) == 0)
-        {
-            parse_IHDR(decoder, chunk_data);
-        }
-        else if (memcmp(chunk_type, "IDAT", 4) == 0)
-        {
-            parse_IDAT(decoder, chunk_data, chunk_size);
-        }
-        else if (memcmp(chunk_type, "tEXt", 4) == 0)
-        {
-            parse_tEXt(decoder, chunk_data, chunk_size);
-        }
-        else if (memcmp(chunk_type, "IEND", 4) == 0)
-        {
-            break;
-        }
-        else
+    LARGE_INTEGER size;
+    if (GetFileType(handle) == FILE_TYPE_DISK && GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
         {
-            fprintf(stderr, "Unknown chunk type: %.4s\n", chunk_type);
+            void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+            if (view)
+            {
+                CloseHandle(handle);
+                decoder->data = (unsigned char *)view;
+                decoder->data_size = (size_t)size.QuadPart;
+                decoder->mapped = 1;
+                return 0;
+            }
+        }
+    }
+
+    // Not mappable: fall back to buffered reads on the same handle
+    int fd = _open_osfhandle((intptr_t)handle, _O_RDONLY);
+    if (fd == -1 || !(file = _fdopen(fd, "rb")))
+    {
+        perror("Failed to open file");
+        CloseHandle(handle);
+        return -1;
+    }
+    int ret = read_input_stream(decoder, file);
+    fclose(file);
+    return ret;
+}
+#else
+int load_input(PNG_decoder_t *decoder, const char *filename)
+{
+    if (strcmp(filename, "-") == 0)
+    {
+        return read_input_stream(decoder, stdin);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Failed to open file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED)
+        {
+            close(fd); // the mapping keeps the file alive
+            decoder->data = (unsigned char *)view;
+            decoder->data_size = (size_t)st.st_size;
+            decoder->mapped = 1;
+            return 0;
+        }
+    }
+
+    // Not mappable: fall back to buffered reads on the same descriptor
+    FILE *file = fdopen(fd, "rb");
+    if (!file)
+    {
+        perror("Failed to open file");
+        close(fd);
+        return -1;
+    }
+    int ret = read_input_stream(decoder, file);
+    fclose(file);
+    return ret;
+}
+#endif
+// Reads until EOF: the size of a pipe is not known in advance, so the buffer grows as needed.
+// The buffer is a large arena allocation, which png_arena_realloc grows without copying through the arena.
+int read_input_stream(PNG_decoder_t *decoder, FILE *file)
+{
+    size_t capacity = 64 * 1024;
+    size_t size = 0;
+    unsigned char *buffer = (unsigned char *)png_arena_alloc(&decoder->arena, capacity);
+    if (!buffer)
+    {
+        fprintf(stderr, "Failed to allocate memory for file data.\n");
+        return -1;
+    }
+
+    size_t read;
+    while ((read = fread(buffer + size, 1, capacity - size, file)) > 0)
+    {
+        size += read;
+        if (size == capacity)
+        {
+            unsigned char *bigger = (unsigned char *)png_arena_realloc(&decoder->arena, buffer, capacity, capacity * 2);
+            if (!bigger)
+            {
+                fprintf(stderr, "Failed to allocate memory for file data.\n");
+                return -1;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+    }
+    if (ferror(file))
+    {
+        perror("Failed to read file");
+        return -1;
+    }
+
+    decoder->data = buffer;
+    decoder->data_size = size;
+    decoder->mapped = 0;
+    return 0;
+}
+void release_input(PNG_decoder_t *decoder)
+{
+    if (decoder->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(decoder->data);
+#else
+        munmap(decoder->data, decoder->data_size);
+#endif
+    }
+    // A read input belongs to the arena and goes with it
+    decoder->data = NULL;
+    decoder->data_size = 0;
+    decoder->mapped = 0;
+}
+void parse_chunks(PNG_decoder_t *decoder)
+{
+    while (decoder->data_size - decoder->offset >= 12) // length + type + CRC
+    {
+        // GOTO line 478 for explanation
+        uint32_t chunk_size = to_big_endian(decoder->data + decoder->offset);
+        decoder->offset += 4;
+
+        // chunk type
+        unsigned char *chunk_type = decoder->data + decoder->offset;
+        decoder->offset += 4;
+
+        // chunck data
+        if (chunk_size > decoder->data_size - decoder->offset || decoder->data_size - decoder->offset - chunk_size < 4)
+        {
+            fprintf(stderr, "Chunk %.4s runs past the end of the file\n", chunk_type);
+            break;
+        }
+        unsigned char *chunk_data = decoder->data + decoder->offset;
+        decoder->offset += chunk_size;
+
+        // CRC: IDAT chunks are checked separately, next to inflate (IDAT_crc_begin)
+        decoder->offset += 4;
+        if (memcmp(chunk_type, "IDAT", 4) != 0 && check_chunk_crc(chunk_type, chunk_size) != 0)
+        {
+            if (!(chunk_type[0] & 0x20)) // critical chunk
+            {
+                fprintf(stderr, "CRC mismatch in %.4s chunk\n", chunk_type);
+                decoder->crc_failed = 1;
+                break;
+            }
+            fprintf(stderr, "CRC mismatch in %.4s chunk, skipping it\n", chunk_type);
+            continue;
+        }
+
+        if (memcmp(chunk_type, "IHDR", 4) == 0)
+        {
+            parse_IHDR(decoder, chunk_data);
+            if (check_IHDR(decoder) != 0)
+            {
+                fprintf(stderr, "Invalid IHDR: %ux%u, bit depth %u, color type %u\n", decoder->width, decoder->height,
+                        decoder->bit_depth, decoder->color_type);
+                decoder->ihdr_invalid = 1;
+                break;
+            }
+        }
+        else if (memcmp(chunk_type, "IDAT", 4) == 0)
+        {
+            parse_IDAT(decoder, chunk_data, chunk_size);
+        }
+        else if (memcmp(chunk_type, "tEXt", 4) == 0)
+        {
+            parse_tEXt(decoder, chunk_data, chunk_size);
+        }
+        else if (memcmp(chunk_type, "iDOT", 4) == 0)
+        {
+            parse_iDOT(decoder, chunk_data, chunk_size);
+        }
+        else if (memcmp(chunk_type, "PLTE", 4) == 0)
+        {
+            parse_PLTE(decoder, chunk_data, chunk_size);
+        }
+        else if (memcmp(chunk_type, "tRNS", 4) == 0)
+        {
+            parse_tRNS(decoder, chunk_data, chunk_size);
+        }
+        else if (memcmp(chunk_type, "IEND", 4) == 0)
+        {
+            break;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown chunk type: %.4s\n", chunk_type);
         }
     }
 }
@@ -232,249 +1252,4822 @@ void parse_IHDR(PNG_decoder_t *decoder, unsigned char *chunk_data)
     decoder->filter_method = chunk_data[11];
     decoder->interlace_method = chunk_data[12];
 }
+// Whether the spec allows bit_depth for color_type
+int valid_bit_depth(unsigned int color_type, unsigned int bit_depth)
+{
+    // Allowed bit depths per color type, as bit masks of the depth values
+    static const unsigned int depths[7] = {
+        (1u << 1) | (1u << 2) | (1u << 4) | (1u << 8) | (1u << 16), // grayscale
+        0,
+        (1u << 8) | (1u << 16), // truecolor
+        (1u << 1) | (1u << 2) | (1u << 4) | (1u << 8), // indexed-color
+        (1u << 8) | (1u << 16), // grayscale with alpha
+        0,
+        (1u << 8) | (1u << 16), // truecolor with alpha
+    };
+    return color_type <= 6 && bit_depth <= 16 && (depths[color_type] & (1u << bit_depth));
+}
+// 0 if the IHDR fields are ones the spec allows, -1 otherwise
+int check_IHDR(const PNG_decoder_t *decoder)
+{
+    if (decoder->width == 0 || decoder->height == 0 || decoder->width > 0x7FFFFFFFu || decoder->height > 0x7FFFFFFFu ||
+        !valid_bit_depth(decoder->color_type, decoder->bit_depth) || decoder->compression_method != 0 ||
+        decoder->filter_method != 0 || decoder->interlace_method > 1)
+    {
+        return -1;
+    }
+    return 0;
+}
 
+// IDAT data is not copied: only where each chunk lives in decoder->data is recorded,
+// and the inflater is pointed at the chunks one by one (see next_IDAT_input).
 void parse_IDAT(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size)
 {
-    decoder->idat_data = (unsigned char *)realloc(decoder->idat_data, decoder->idat_size + chunk_size);
-    memcpy(decoder->idat_data + decoder->idat_size, chunk_data, chunk_size);
+    if (decoder->idat_count == decoder->idat_capacity)
+    {
+        size_t new_capacity = decoder->idat_capacity ? decoder->idat_capacity * 2 : 16;
+        IDAT_span_t *spans = (IDAT_span_t *)png_arena_realloc(&decoder->arena, decoder->idat_spans, decoder->idat_capacity * sizeof(IDAT_span_t), new_capacity * sizeof(IDAT_span_t));
+        if (!spans)
+        {
+            fprintf(stderr, "Failed to allocate memory for IDAT chunk list.\n");
+            return;
+        }
+        decoder->idat_spans = spans;
+        decoder->idat_capacity = new_capacity;
+    }
+
+    decoder->idat_spans[decoder->idat_count].offset = chunk_data - decoder->data;
+    decoder->idat_spans[decoder->idat_count].size = chunk_size;
+    decoder->idat_count++;
     decoder->idat_size += chunk_size;
 }
 
 void parse_tEXt(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size)
 {
-    decoder->texts = (char **)realloc(decoder->texts, (decoder->text_count + 1) * sizeof(char *));
-    decoder->texts[decoder->text_count] = (char *)malloc(chunk_size + 1);
+    char **texts = (char **)png_arena_realloc(&decoder->arena, decoder->texts, decoder->text_count * sizeof(char *), (decoder->text_count + 1) * sizeof(char *));
+    char *text = (char *)png_arena_alloc(&decoder->arena, chunk_size + 1);
+    if (!texts || !text)
+    {
+        fprintf(stderr, "Failed to allocate memory for tEXt chunk.\n");
+        return;
+    }
+    decoder->texts = texts;
+    decoder->texts[decoder->text_count] = text;
     memcpy(decoder->texts[decoder->text_count], chunk_data, chunk_size);
     decoder->texts[decoder->text_count][chunk_size] = '\0';
     decoder->text_count++;
 }
+// The palette becomes a 256-entry lookup table right away, so expanding a pixel
+// is a single load with no bounds check (see Palette)
+void parse_PLTE(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size)
+{
+    if (chunk_size == 0 || chunk_size % 3 != 0 || chunk_size > 256 * 3)
+    {
+        fprintf(stderr, "Ignoring PLTE chunk of %zu bytes\n", chunk_size);
+        return;
+    }
+    uint32_t *palette = (uint32_t *)png_arena_alloc(&decoder->arena, 256 * sizeof(uint32_t));
+    if (!palette)
+    {
+        fprintf(stderr, "Failed to allocate memory for palette.\n");
+        return;
+    }
+    decoder->palette_size = (unsigned int)(chunk_size / 3);
+    for (size_t i = 0; i < 256; i++)
+    {
+        // Out of range indices come out opaque black instead of failing the image
+        unsigned char entry[4] = {0, 0, 0, 255};
+        if (i < decoder->palette_size)
+        {
+            memcpy(entry, chunk_data + 3 * i, 3);
+        }
+        memcpy(&palette[i], entry, 4);
+    }
+    decoder->palette = palette;
+}
+// Alpha of the first palette entries; the color keys of gray and truecolor images are not applied
+void parse_tRNS(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size)
+{
+    if (decoder->color_type != 3)
+    {
+        return;
+    }
+    if (!decoder->palette || chunk_size > decoder->palette_size)
+    {
+        fprintf(stderr, "Ignoring tRNS chunk that does not match the palette\n");
+        return;
+    }
+    for (size_t i = 0; i < chunk_size; i++)
+    {
+        ((unsigned char *)&decoder->palette[i])[3] = chunk_data[i];
+    }
+    decoder->palette_alpha = 1;
+}
+// Once the current chunk is used up, point io->next_in at the next IDAT chunk.
+// Returns 0 when every chunk has been handed over.
+int next_IDAT_input(PNG_decoder_t *decoder, inflate_io_t *io, size_t *span_index)
+{
+    while (io->avail_in == 0)
+    {
+        if (*span_index >= decoder->idat_count)
+        {
+            return 0;
+        }
+        IDAT_span_t *span = &decoder->idat_spans[(*span_index)++];
+        io->next_in = decoder->data + span->offset;
+        io->avail_in = span->size;
+    }
+    return 1;
+}
 int decompress_IDAT(PNG_decoder_t *decoder, unsigned char **out_data, size_t *out_size)
 {
+    *out_data = NULL;
 
-    // STANDARD METHOD FROM .zlib IN C FOR DECOMPRESSION
-
-    z_stream stream; // struct of zlib for compress/decompress data
-    memset(&stream, 0, sizeof(stream));
-
-    if (inflateInit(&stream) != Z_OK)
+    // buffer for decompressed data: every row plus its filter byte, pass by pass for Adam7
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
     {
-        fprintf(stderr, "Failed to initialize zlib for decompression.\n");
         return -1;
     }
-
-    //Stream.in
-    stream.next_in = decoder->idat_data;  // stream.next_in: Pointer data to decompress
-    stream.avail_in = decoder->idat_size; // stream.avail_in: data size
-
-    // buffer for decompressed data
-    size_t buffer_size = decoder->width * decoder->height * 4 + decoder->height; // + decoder->height: for add filter
-    *out_data = (unsigned char *)malloc(buffer_size);
+    adam7_pass_t passes[7];
+    size_t buffer_size = decoder->interlace_method == 1 ? locate_adam7_passes(decoder, bytes_per_pixel, passes)
+                                                        : (get_row_size(decoder, bytes_per_pixel) + 1) * decoder->height;
+    *out_data = (unsigned char *)png_arena_alloc(&decoder->arena, buffer_size);
     if (!(*out_data))
     {
         fprintf(stderr, "Failed to allocate memory for decompressed data.\n");
-        inflateEnd(&stream);
         return -1;
     }
 
-    stream.next_out = *out_data;    // pointer to buffer for decompressed data (not yet decompressed)
-    stream.avail_out = buffer_size; // data size
-
-    // Decompress data
-    int ret = inflate(&stream, Z_FINISH); // inflate: decompress data from stream.next_in to stream.next_out
-    if (ret != Z_STREAM_END)
+    inflater_t inflater;
+    if (inflater_init(&inflater, png_get_inflate_backend(), 0, &decoder->arena) != 0)
     {
-        fprintf(stderr, "Failed to decompress IDAT data: %d\n", ret);
-        // free(*out_data);
-        inflateEnd(&stream);
         return -1;
     }
-
-    *out_size = stream.total_out;
-
-    inflateEnd(&stream);
-
-    return 0;
-}
-
-#pragma endregion
-
-#pragma region Filters
-void no_filter(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width)
-{
-    memcpy(output, scanline, width * bytes_per_pixel);
+    int ret = inflate_IDAT(decoder, &inflater, *out_data, buffer_size, out_size);
+    inflater_end(&inflater);
+    return ret;
 }
-void sub_filter(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width)
+// Inflates the whole IDAT stream into out_data with a freshly initialized or reset inflater
+int inflate_IDAT(PNG_decoder_t *decoder, inflater_t *inflater, unsigned char *out_data, size_t buffer_size, size_t *out_size)
 {
-    for (size_t x = 0; x < width; x++)
+    const inflate_backend_t *backend = inflater->backend;
+    inflater->io.next_out = out_data; // pointer to buffer for decompressed data (not yet decompressed)
+    inflater->io.avail_out = buffer_size;
+
+    if (backend->whole_buffer && backend->reads_spans)
     {
-        for (size_t y = 0; y < bytes_per_pixel; y++)
+        // The chunks stay where they are in the file
+        inflater->io.span_base = decoder->data;
+        inflater->io.spans = decoder->idat_spans;
+        inflater->io.span_count = decoder->idat_count;
+        if (decoder->idat_count == 0)
+        {
+            fprintf(stderr, "No IDAT data\n");
+            inflater->status = INFLATE_ERROR;
+        }
+        else
         {
-            unsigned char left = (x == 0) ? 0 : output[(x - 1) * bytes_per_pixel + y];
-            output[x * bytes_per_pixel + y] = scanline[x * bytes_per_pixel + y] + left;
+            inflater->status = backend->feed(inflater->state, &inflater->io);
         }
     }
-}
-void up_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
-{
-    for (size_t x = 0; x < width * bytes_per_pixel; x++)
+    else if (backend->whole_buffer)
     {
-        unsigned char up = (prev_scanline == NULL) ? 0 : prev_scanline[x];
-        output[x] = scanline[x] + up;
+        inflater->io.spans = NULL;
+        inflater->io.next_in = join_IDAT(decoder);
+        inflater->io.avail_in = decoder->idat_size;
+        inflater->status = inflater->io.next_in ? backend->feed(inflater->state, &inflater->io) : INFLATE_ERROR;
     }
-}
-void average_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
-{
-    // reconstructed = raw + ((left + up) / 2)
-
-    for (size_t x = 0; x < width; x++)
+    else
     {
-        for (size_t y = 0; y < bytes_per_pixel; y++)
+        // Stream.in: filled chunk by chunk by next_IDAT_input
+        size_t span_index = 0;
+        do
         {
-            unsigned char left = (x == 0) ? 0 : output[(x - 1) * bytes_per_pixel + y];
-            unsigned char up = (prev_scanline == NULL) ? 0 : prev_scanline[x * bytes_per_pixel + y];
+            next_IDAT_input(decoder, &inflater->io, &span_index);
+            inflater->status = backend->feed(inflater->state, &inflater->io);
+        } while (inflater->status == INFLATE_MORE);
+    }
 
-            output[x * bytes_per_pixel + y] = scanline[x * bytes_per_pixel + y] + ((left + up) / 2);
-        }
+    if (inflater->status != INFLATE_END)
+    {
+        fprintf(stderr, "Failed to decompress IDAT data.\n");
+        return -1;
     }
+    *out_size = buffer_size - inflater->io.avail_out;
+    return 0;
 }
-unsigned char paeth_predictor(unsigned char left, unsigned char up, unsigned char upper_left)
-{
-    // The prediction minimizes the sum of absolute differences between the actual value and the three neighbors.
 
-    int p = left + up - upper_left;
-    int pa = abs(p - left);
-    int pb = abs(p - up);
-    int pc = abs(p - upper_left);
+#pragma endregion
 
-    // Return the neighbor (left, up, or upper_left) with the smallest difference (pa, pb, pc).
-    if (pa <= pb && pa <= pc)
-        return left;
-    else if (pb <= pc)
-        return up;
-    else
-        return upper_left;
-}
-void paeth_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
-{
-    // reconstructed = raw + predicted
+#pragma region Probe
+/* An admission check only needs the image size and format, which sit in
+   the first 33 bytes of every valid PNG: the signature, then the IHDR chunk
+   (length, type, 13 bytes of data, CRC), which must come first. png_probe
+   reads exactly those with one pread, where initialize_decoder maps the
+   whole file and parse_chunks walks every chunk.
+   Both functions are quiet: a file that is not a PNG, is truncated or has
+   an invalid IHDR just returns -1, since screening many files is their job. */
+#define PNG_PROBE_SIZE (8 + 4 + 4 + 13 + 4)
 
-    for (size_t x = 0; x < width; x++)
+int png_probe(const char *path, PNG_info_t *info)
+{
+    unsigned char header[PNG_PROBE_SIZE];
+    size_t read = 0;
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
     {
-        for (size_t y = 0; y < bytes_per_pixel; y++)
-        {
-            unsigned char left = (x == 0) ? 0 : output[(x - 1) * bytes_per_pixel + y];
-            unsigned char up = (prev_scanline == NULL) ? 0 : prev_scanline[x * bytes_per_pixel + y];
-            unsigned char upper_left = (x == 0 || prev_scanline == NULL) ? 0 : prev_scanline[(x - 1) * bytes_per_pixel + y];
-
-            unsigned char predicted = paeth_predictor(left, up, upper_left);
-            output[x * bytes_per_pixel + y] = scanline[x * bytes_per_pixel + y] + predicted;
-        }
+        return -1;
+    }
+    DWORD got = 0;
+    if (ReadFile(handle, header, sizeof(header), &got, NULL))
+    {
+        read = got;
     }
+    CloseHandle(handle);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    if (got > 0)
+    {
+        read = (size_t)got;
+    }
+#endif
+    return png_probe_mem(header, read, info);
 }
-
-unsigned char *apply_filters(PNG_decoder_t *decoder, unsigned char *decompressed_data)
+// buffer holds the start of a PNG file; only its first PNG_PROBE_SIZE bytes are looked at
+int png_probe_mem(const unsigned char *buffer, size_t size, PNG_info_t *info)
 {
-    /*Calculate the number of bytes per pixel based on the bit depth and color type.
-        decoder->bit_depth / 8: Converts bit depth (8 or 16 bits per channel) into bytes per channel.
-        decoder->color_type == 2: Checks if the color type is Truecolor (RGB, 3 channels).
-       If Truecolor, multiplies by 3 to account for red, green, and blue channels, if 1 channel multiplies to 1.
-
-     TODO: Limitations
-     This calculation assumes only Truecolor (RGB) and single-channel formats.
-     It does not handle other valid PNG color types, such as:
-       - Truecolor with alpha (RGBA, 4 channels)
-       - Grayscale with alpha (2 channels) */
-    size_t bytes_per_pixel;
-
-    switch (decoder->color_type)
+    if (size < PNG_PROBE_SIZE || memcmp(buffer, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0 ||
+        memcmp(buffer + 8, "\0\0\0\x0DIHDR", 8) != 0)
     {
-    case 0: // Grayscale
-        bytes_per_pixel = (decoder->bit_depth <= 8) ? 1 : 2;
-        break;
-    case 2: // Truecolor (RGB)
-        bytes_per_pixel = (decoder->bit_depth <= 8) ? 3 : 6;
-        break;
-    case 3: // Indexed-color (palette)
-        bytes_per_pixel = 1; // Always 1 byte per pixel (index in palette)
-        break;
-    case 4: // Grayscale + Alpha
-        bytes_per_pixel = (decoder->bit_depth <= 8) ? 2 : 4;
-        break;
-    case 6: // Truecolor + Alpha (RGBA)
-        bytes_per_pixel = (decoder->bit_depth <= 8) ? 4 : 8;
-        break;
-    default:
-        fprintf(stderr, "Unsupported color type: %u\n", decoder->color_type);
-        return NULL;
+        return -1;
+    }
+    // The CRC covers the chunk type and data
+    uint32_t crc = ((uint32_t)buffer[29] << 24) | ((uint32_t)buffer[30] << 16) | ((uint32_t)buffer[31] << 8) | buffer[32];
+    init_crc32();
+    if (png_crc32(0, buffer + 12, 4 + 13) != crc)
+    {
+        return -1;
     }
 
-    size_t scanline_size = ((decoder->width * decoder->bit_depth + 7) / 8) * bytes_per_pixel + 1;
-
-    unsigned char *output = (unsigned char *)malloc(decoder->width * decoder->height * bytes_per_pixel);
-    if (!output)
+    PNG_decoder_t decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    parse_IHDR(&decoder, (unsigned char *)buffer + 16); // only reads
+    if (check_IHDR(&decoder) != 0)
     {
-        fprintf(stderr, "Failed to allocate memory for filtered image.\n");
-        return NULL;
+        return -1;
     }
 
-    unsigned char *prev_scanline = NULL;
-    unsigned char *current_output = output;
+    info->width = decoder.width;
+    info->height = decoder.height;
+    info->bit_depth = decoder.bit_depth;
+    info->color_type = decoder.color_type;
+    info->compression_method = decoder.compression_method;
+    info->filter_method = decoder.filter_method;
+    info->interlace_method = decoder.interlace_method;
+    return 0;
+}
+#pragma endregion
 
-    size_t filter_counts[5] = {0};
+#pragma region CRC
+/* Every chunk ends with a CRC-32 of its type and data. By default it is
+   skipped: a corrupt upload then shows up, if at all, as an inflate error
+   deep inside the IDAT data, or as a wrong picture. --crc critical (or
+   PNG_DECODER_CRC=critical) checks IHDR, PLTE, IDAT and IEND and fails the
+   decode on a mismatch; --crc all also checks ancillary chunks and drops
+   the ones that do not match, like libpng does.
+   To keep the check in the noise:
+   - png_crc32 folds 16 bytes per carry-less multiply with PCLMULQDQ when
+     the CPU has it (and --isa is not scalar), and uses slice-by-8 tables
+     for the tail and on other CPUs;
+   - the IDAT chunks are checked by IDAT_crc_begin / IDAT_crc_end, on a
+     thread of their own while the decode inflates the same bytes when they
+     add up to PNG_CRC_PARALLEL_MIN or more, and inline before decoding
+     otherwise. Every other chunk is checked in parse_chunks. */
+#define PNG_CRC_PARALLEL_MIN (1 << 20)
 
-    for (size_t y = 0; y < decoder->height; y++)
+static uint32_t crc_tables[8][256]; // crc_tables[k][n]: CRC of byte n followed by k zero bytes
+static png_once_t crc_once = PNG_ONCE_INIT;
+static int crc_has_pclmul = 0;
+static PNG_crc_mode_t crc_mode = PNG_CRC_NONE;
+const char *crc_mode_names[] = {"none", "critical", "all"};
+
+// Runs once, through png_call_once: the tables are complete before any caller returns from init_crc32
+static void setup_crc32(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
     {
-        unsigned char filter_type = decompressed_data[y * scanline_size];
-        if (filter_type > 4)
+        uint32_t c = n;
+        for (int bit = 0; bit < 8; bit++)
         {
-            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, y);
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1; // reflected polynomial of CRC-32
         }
+        crc_tables[0][n] = c;
     }
-    for (size_t y = 0; y < decoder->height; y++)
+    for (uint32_t n = 0; n < 256; n++)
     {
-        unsigned char filter_type = decompressed_data[y * scanline_size];
-        unsigned char *scanline = decompressed_data + y * scanline_size + 1;
-
-        filter_counts[filter_type]++;
-
-        switch (filter_type)
+        for (int k = 1; k < 8; k++)
         {
-        case 0:
-            no_filter(current_output, scanline, bytes_per_pixel, decoder->width);
-            break;
-        case 1:
-            sub_filter(current_output, scanline, bytes_per_pixel, decoder->width);
-            break;
-        case 2:
-            up_filter(current_output, scanline, prev_scanline, bytes_per_pixel, decoder->width);
-            break;
-        case 3:
-            average_filter(current_output, scanline, prev_scanline, bytes_per_pixel, decoder->width);
-            break;
-        case 4:
-            paeth_filter(current_output, scanline, prev_scanline, bytes_per_pixel, decoder->width);
-            break;
-        default:
-            fprintf(stderr, "Unsupported filter type: %u\n", filter_type);
-            free(output);
-            return NULL;
+            crc_tables[k][n] = (crc_tables[k - 1][n] >> 8) ^ crc_tables[0][crc_tables[k - 1][n] & 0xFF];
         }
-
-        prev_scanline = current_output;
-        current_output += decoder->width * bytes_per_pixel;
     }
+#if PNG_SIMD_AVX2
+    __builtin_cpu_init();
+    crc_has_pclmul = __builtin_cpu_supports("pclmul") != 0;
+#endif
 
-    // Print filter counts
-    printf("Filter Counts:\n");
-    for (size_t i = 0; i < 5; i++)
+    const char *forced = getenv("PNG_DECODER_CRC");
+    PNG_crc_mode_t mode;
+    if (forced && *forced && parse_crc_mode(forced, &mode) == 0)
     {
-        printf("Filter %zu: %zu times\n", i, filter_counts[i]);
+        crc_mode = mode;
+    }
+}
+// Builds the tables and probes the CPU; honors PNG_DECODER_CRC. Safe to call from any thread, any number of times.
+void init_crc32(void)
+{
+    png_call_once(&crc_once, setup_crc32);
+}
+// crc is the running register (already inverted), 8 bytes per step
+uint32_t crc32_slice8(uint32_t crc, const unsigned char *data, size_t size)
+{
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t high = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc_tables[7][low & 0xFF] ^ crc_tables[6][(low >> 8) & 0xFF] ^
+              crc_tables[5][(low >> 16) & 0xFF] ^ crc_tables[4][low >> 24] ^
+              crc_tables[3][high & 0xFF] ^ crc_tables[2][(high >> 8) & 0xFF] ^
+              crc_tables[1][(high >> 16) & 0xFF] ^ crc_tables[0][high >> 24];
+    }
+    for (; size > 0; size--)
+    {
+        crc = crc_tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+#if PNG_SIMD_AVX2
+/* Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ",
+   reflected form: four 128-bit lanes are folded forward 64 bytes at a time,
+   then folded into one lane, reduced to 64 and 32 bits and finished with a
+   Barrett reduction. The constants are x^k mod P(x) for the fold distances.
+   size must be at least 64 and a multiple of 16; crc is the running register. */
+static PNG_TARGET_PCLMUL PNG_ALWAYS_INLINE __m128i crc_fold(__m128i x, __m128i k, __m128i next)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+PNG_TARGET_PCLMUL uint32_t crc32_pclmul(uint32_t crc, const unsigned char *data, size_t size)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4); // fold by 512 bits
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0); // fold by 128 bits
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641); // mu, P(x)
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)data), _mm_cvtsi32_si128((int)crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+    data += 64;
+    size -= 64;
+    for (; size >= 64; size -= 64, data += 64)
+    {
+        x1 = crc_fold(x1, k1k2, _mm_loadu_si128((const __m128i *)data));
+        x2 = crc_fold(x2, k1k2, _mm_loadu_si128((const __m128i *)(data + 16)));
+        x3 = crc_fold(x3, k1k2, _mm_loadu_si128((const __m128i *)(data + 32)));
+        x4 = crc_fold(x4, k1k2, _mm_loadu_si128((const __m128i *)(data + 48)));
+    }
+    x1 = crc_fold(x1, k3k4, x2);
+    x1 = crc_fold(x1, k3k4, x3);
+    x1 = crc_fold(x1, k3k4, x4);
+    for (; size >= 16; size -= 16, data += 16)
+    {
+        x1 = crc_fold(x1, k3k4, _mm_loadu_si128((const __m128i *)data));
+    }
+
+    // 128 -> 64 bits, 64 -> 32 bits
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00));
+    // Barrett reduction to the 32-bit remainder
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+// Same contract as zlib's crc32: start from 0, feed the result back in to continue
+uint32_t png_crc32(uint32_t crc, const unsigned char *data, size_t size)
+{
+    crc = ~crc;
+#if PNG_SIMD_AVX2
+    if (crc_has_pclmul && size >= 64 && png_get_isa_level() != PNG_ISA_SCALAR)
+    {
+        size_t bulk = size & ~(size_t)15;
+        crc = crc32_pclmul(crc, data, bulk);
+        data += bulk;
+        size -= bulk;
+    }
+#endif
+    return ~crc32_slice8(crc, data, size);
+}
+int parse_crc_mode(const char *name, PNG_crc_mode_t *mode)
+{
+    for (int i = PNG_CRC_NONE; i <= PNG_CRC_ALL; i++)
+    {
+        if (strcmp(name, crc_mode_names[i]) == 0)
+        {
+            *mode = (PNG_crc_mode_t)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown CRC mode: %s (expected none, critical or all)\n", name);
+    return -1;
+}
+void png_set_crc_mode(PNG_crc_mode_t mode)
+{
+    init_crc32(); // an explicit choice wins over the environment
+    crc_mode = mode;
+}
+PNG_crc_mode_t png_get_crc_mode(void)
+{
+    return crc_mode;
+}
+// -1 if the chunk is checked in the current mode and its CRC does not match.
+// chunk_type is followed by chunk_size bytes of data and the CRC.
+int check_chunk_crc(const unsigned char *chunk_type, size_t chunk_size)
+{
+    int critical = !(chunk_type[0] & 0x20); // bit 5 of the first letter: ancillary
+    if (crc_mode == PNG_CRC_NONE || (crc_mode == PNG_CRC_CRITICAL && !critical))
+    {
+        return 0;
+    }
+    const unsigned char *stored = chunk_type + 4 + chunk_size;
+    uint32_t expected = ((uint32_t)stored[0] << 24) | ((uint32_t)stored[1] << 16) | ((uint32_t)stored[2] << 8) | stored[3];
+    return png_crc32(0, chunk_type, 4 + chunk_size) == expected ? 0 : -1;
+}
+// Checks the CRC of every IDAT chunk; the body of IDAT_crc_begin's thread
+void *verify_IDAT_crc(void *arg)
+{
+    IDAT_crc_check_t *check = (IDAT_crc_check_t *)arg;
+    PNG_decoder_t *decoder = check->decoder;
+    for (size_t i = 0; i < decoder->idat_count; i++)
+    {
+        IDAT_span_t *span = &decoder->idat_spans[i];
+        if (check_chunk_crc(decoder->data + span->offset - 4, span->size) != 0) // - 4: the chunk type
+        {
+            fprintf(stderr, "CRC mismatch in IDAT chunk %zu\n", i);
+            check->status = -1;
+            return NULL;
+        }
+    }
+    check->status = 0;
+    return NULL;
+}
+/* Starts checking the IDAT CRCs. Small IDAT data is checked right away and
+   a mismatch returned here; large data is handed to a thread, and the
+   result comes from IDAT_crc_end, which must be called before the input is
+   released either way. The thread only reads decoder->data and the spans. */
+int IDAT_crc_begin(PNG_decoder_t *decoder, IDAT_crc_check_t *check)
+{
+    memset(check, 0, sizeof(*check));
+    check->decoder = decoder;
+    if (crc_mode == PNG_CRC_NONE)
+    {
+        return 0;
+    }
+    if (decoder->idat_size >= PNG_CRC_PARALLEL_MIN && png_thread_create(&check->thread, verify_IDAT_crc, check) == 0)
+    {
+        check->threaded = 1;
+        return 0;
+    }
+    verify_IDAT_crc(check);
+    return check->status;
+}
+int IDAT_crc_end(IDAT_crc_check_t *check)
+{
+    if (check->threaded)
+    {
+        png_thread_join(check->thread);
+        check->threaded = 0;
+    }
+    return check->status;
+}
+#pragma endregion
+
+#pragma region Inflate
+/* In-tree DEFLATE decoder, the "builtin" whole-buffer backend (see
+   Inflate backends).
+   zlib has to be able to stop and resume after any byte, so it consumes the
+   input a bit field at a time and checks for the end of both buffers on
+   every symbol. Here the whole compressed stream and the whole output
+   buffer are known up front, which allows:
+   - a 64-bit bit buffer topped up with one unaligned 8-byte load, so one
+     refill covers a full length/distance pair (at most 48 bits);
+   - decode tables indexed by the next 11 (literal/length) or 8 (distance)
+     bits that give symbol, extra bit count and base in one lookup, with a
+     second-level table for the few longer codes, and root entries that
+     decode two short literals at once;
+   - match copies done 16 or 8 bytes at a time, letting the last chunk
+     run past the end of the match, while the output has room for it. */
+
+// Decode table entry: value << 16 | kind << 12 | extra bits << 8 | bits to consume.
+// For DECODE_SUBTABLE the value is the subtable start and "extra bits" its index width.
+#define DECODE_LITERAL 0
+#define DECODE_LITERAL2 1 // two literals, value = first | second << 8
+#define DECODE_LENGTH 2   // length or distance base
+#define DECODE_END 3      // end of block
+#define DECODE_SUBTABLE 4
+#define DECODE_INVALID 5
+
+#define DECODE_ENTRY(value, kind, extra) (((uint32_t)(value) << 16) | ((uint32_t)(kind) << 12) | ((uint32_t)(extra) << 8))
+#define DECODE_KIND(entry) (((entry) >> 12) & 0xF)
+
+#define LITLEN_TABLE_BITS 11
+#define DISTANCE_TABLE_BITS 8
+#define PRECODE_TABLE_BITS 7
+// Root table plus the largest possible set of second-level tables, all of them
+// 2^(15 - table bits) entries wide: one per symbol whose code is longer than the root
+#define LITLEN_TABLE_SIZE ((1 << LITLEN_TABLE_BITS) + 288 * (1 << (15 - LITLEN_TABLE_BITS)))
+#define DISTANCE_TABLE_SIZE ((1 << DISTANCE_TABLE_BITS) + 32 * (1 << (15 - DISTANCE_TABLE_BITS)))
+
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                               3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                           257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                                 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Canonical Huffman codes (RFC 1951 3.2.2) into a decode table. DEFLATE
+   sends codes MSB first but packs them LSB first, so every code is indexed
+   bit-reversed. symbol_entries gives each symbol's entry without the length.
+   Returns -1 for an over-subscribed code, or an incomplete one other than
+   the single one-bit code the format allows. */
+int build_decode_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count,
+                       const uint32_t *symbol_entries, unsigned int table_bits, int allow_incomplete)
+{
+    unsigned int count[16] = {0};
+    for (size_t i = 0; i < symbol_count; i++)
+    {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+
+    unsigned int max_length = 15;
+    while (max_length > 0 && count[max_length] == 0)
+    {
+        max_length--;
+    }
+
+    int left = 1;
+    for (unsigned int length = 1; length <= 15; length++)
+    {
+        left = (left << 1) - (int)count[length];
+        if (left < 0)
+        {
+            return -1; // over-subscribed
+        }
+    }
+    if (left > 0 && (!allow_incomplete || max_length > 1))
+    {
+        return -1; // incomplete
+    }
+
+    // Symbols sorted by code length, then by value: the canonical code order
+    uint16_t sorted[288];
+    unsigned int offsets[17];
+    offsets[1] = 0;
+    for (unsigned int length = 1; length < 16; length++)
+    {
+        offsets[length + 1] = offsets[length] + count[length];
+    }
+    for (size_t i = 0; i < symbol_count; i++)
+    {
+        if (lengths[i])
+        {
+            sorted[offsets[lengths[i]]++] = (uint16_t)i;
+        }
+    }
+
+    size_t table_size = (size_t)1 << table_bits;
+    for (size_t i = 0; i < table_size; i++)
+    {
+        table[i] = DECODE_ENTRY(0, DECODE_INVALID, 0);
+    }
+
+    unsigned int sub_bits = max_length > table_bits ? max_length - table_bits : 0;
+    size_t next_subtable = table_size;
+    size_t subtable = 0;
+    size_t prefix = (size_t)-1;
+    uint32_t code = 0; // next code, MSB first
+    size_t index = 0;
+    for (unsigned int length = 1; length <= max_length; length++, code <<= 1)
+    {
+        for (unsigned int k = 0; k < count[length]; k++, code++)
+        {
+            uint32_t entry = symbol_entries[sorted[index++]];
+            uint32_t reversed = 0;
+            for (unsigned int bit = 0; bit < length; bit++)
+            {
+                reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+            }
+
+            if (length <= table_bits)
+            {
+                for (size_t i = reversed; i < table_size; i += (size_t)1 << length)
+                {
+                    table[i] = entry | length;
+                }
+                continue;
+            }
+
+            // Codes sharing their first table_bits bits are adjacent in canonical order
+            if ((reversed & (table_size - 1)) != prefix)
+            {
+                prefix = reversed & (table_size - 1);
+                subtable = next_subtable;
+                next_subtable += (size_t)1 << sub_bits;
+                for (size_t i = 0; i < ((size_t)1 << sub_bits); i++)
+                {
+                    table[subtable + i] = DECODE_ENTRY(0, DECODE_INVALID, 0);
+                }
+                table[prefix] = DECODE_ENTRY(subtable, DECODE_SUBTABLE, sub_bits) | table_bits;
+            }
+            for (size_t i = reversed >> table_bits; i < ((size_t)1 << sub_bits); i += (size_t)1 << (length - table_bits))
+            {
+                table[subtable + i] = entry | (length - table_bits);
+            }
+        }
+    }
+    return 0;
+}
+// Root entries for a short literal followed by another short literal decode both at once
+void pair_literals(uint32_t *table)
+{
+    // Descending: table[i >> length] (< i) is still a single-symbol entry when it is read
+    for (size_t i = ((size_t)1 << LITLEN_TABLE_BITS); i-- > 0;)
+    {
+        uint32_t first = table[i];
+        unsigned int first_length = first & 0xFF;
+        if (DECODE_KIND(first) != DECODE_LITERAL || first_length >= LITLEN_TABLE_BITS)
+        {
+            continue;
+        }
+        uint32_t second = table[i >> first_length];
+        unsigned int second_length = second & 0xFF;
+        if (DECODE_KIND(second) == DECODE_LITERAL && second_length <= LITLEN_TABLE_BITS - first_length)
+        {
+            table[i] = DECODE_ENTRY((first >> 16) | ((second >> 16) << 8), DECODE_LITERAL2, 0) | (first_length + second_length);
+        }
+    }
+}
+int build_litlen_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count)
+{
+    uint32_t entries[288];
+    for (size_t i = 0; i < 288; i++)
+    {
+        if (i < 256)
+        {
+            entries[i] = DECODE_ENTRY(i, DECODE_LITERAL, 0);
+        }
+        else if (i == 256)
+        {
+            entries[i] = DECODE_ENTRY(0, DECODE_END, 0);
+        }
+        else if (i < 286)
+        {
+            entries[i] = DECODE_ENTRY(length_base[i - 257], DECODE_LENGTH, length_extra[i - 257]);
+        }
+        else
+        {
+            entries[i] = DECODE_ENTRY(0, DECODE_INVALID, 0);
+        }
+    }
+    if (build_decode_table(table, lengths, symbol_count, entries, LITLEN_TABLE_BITS, 0) != 0)
+    {
+        return -1;
+    }
+    pair_literals(table);
+    return 0;
+}
+int build_distance_table(uint32_t *table, const unsigned char *lengths, size_t symbol_count)
+{
+    uint32_t entries[32];
+    for (size_t i = 0; i < 32; i++)
+    {
+        entries[i] = i < 30 ? DECODE_ENTRY(distance_base[i], DECODE_LENGTH, distance_extra[i]) : DECODE_ENTRY(0, DECODE_INVALID, 0);
+    }
+    // A block with only literals may send no distance codes at all
+    return build_decode_table(table, lengths, symbol_count, entries, DISTANCE_TABLE_BITS, 1);
+}
+
+struct inflate_state
+{
+    const unsigned char *in_next;
+    const unsigned char *in_end;   // end of the current piece of input
+    const unsigned char *in_base;  // the input is spans[0..span_count) of in_base, read in order
+    const IDAT_span_t *spans;
+    size_t span_count;
+    size_t span_index;             // piece in_next points into
+    size_t piece_start;            // stream offset of its first byte
+    uint64_t bits;          // next input bits, LSB first
+    unsigned int bit_count; // valid bits in bits
+    unsigned int overrun;   // zero bytes made up past the end of the input
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t distance[DISTANCE_TABLE_SIZE];
+};
+
+// Puts the input at the start of piece index
+static void enter_piece(inflate_state_t *s, size_t index, size_t piece_start)
+{
+    s->span_index = index;
+    s->piece_start = piece_start;
+    s->in_next = s->in_base + s->spans[index].offset;
+    s->in_end = s->in_next + s->spans[index].size;
+}
+static void set_input(inflate_state_t *s, const unsigned char *base, const IDAT_span_t *spans, size_t span_count)
+{
+    s->in_base = base;
+    s->spans = spans;
+    s->span_count = span_count;
+    enter_piece(s, 0, 0);
+}
+// Moves on to the next non-empty piece; 0 at the end of the input
+static int next_piece(inflate_state_t *s)
+{
+    while (s->span_index + 1 < s->span_count)
+    {
+        enter_piece(s, s->span_index + 1, s->piece_start + s->spans[s->span_index].size);
+        if (s->in_next < s->in_end)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+// Stream offset of in_next
+static size_t input_position(const inflate_state_t *s)
+{
+    return s->piece_start + (size_t)(s->in_next - (s->in_base + s->spans[s->span_index].offset));
+}
+// Back to an earlier stream offset: only ever a few bytes, so at most a piece or two back
+static void rewind_input(inflate_state_t *s, size_t position)
+{
+    while (position < s->piece_start)
+    {
+        enter_piece(s, s->span_index - 1, s->piece_start - s->spans[s->span_index - 1].size);
+    }
+    s->in_next = s->in_base + s->spans[s->span_index].offset + (position - s->piece_start);
+}
+// Copies the next size bytes of input, across pieces; -1 if the input ends first
+static int read_input(inflate_state_t *s, unsigned char *out, size_t size)
+{
+    while (size > 0)
+    {
+        if (s->in_next == s->in_end && !next_piece(s))
+        {
+            return -1;
+        }
+        size_t count = (size_t)(s->in_end - s->in_next) < size ? (size_t)(s->in_end - s->in_next) : size;
+        memcpy(out, s->in_next, count);
+        s->in_next += count;
+        out += count;
+        size -= count;
+    }
+    return 0;
+}
+// Tops the bit buffer up to at least 56 bits
+static PNG_ALWAYS_INLINE void refill_bits(inflate_state_t *s)
+{
+    if (s->in_end - s->in_next >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, s->in_next, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        s->bits |= word << s->bit_count;
+        s->in_next += (63 - s->bit_count) >> 3;
+        s->bit_count |= 56;
+        return;
+    }
+    // Last few bytes of a piece, then the next piece; past the end read zeros, which a valid stream never uses
+    while (s->bit_count <= 56)
+    {
+        if (s->in_next < s->in_end || next_piece(s))
+        {
+            s->bits |= (uint64_t)*s->in_next++ << s->bit_count;
+        }
+        else
+        {
+            s->overrun++;
+        }
+        s->bit_count += 8;
+    }
+}
+static PNG_ALWAYS_INLINE uint32_t take_bits(inflate_state_t *s, unsigned int count)
+{
+    uint32_t value = (uint32_t)(s->bits & (((uint64_t)1 << count) - 1));
+    s->bits >>= count;
+    s->bit_count -= count;
+    return value;
+}
+// Resolves a subtable pointer and consumes the code's bits
+static PNG_ALWAYS_INLINE uint32_t decode_symbol(inflate_state_t *s, const uint32_t *table, unsigned int table_bits)
+{
+    uint32_t entry = table[s->bits & (((uint64_t)1 << table_bits) - 1)];
+    if (DECODE_KIND(entry) == DECODE_SUBTABLE)
+    {
+        take_bits(s, table_bits);
+        entry = table[(entry >> 16) + (s->bits & (((uint64_t)1 << ((entry >> 8) & 0xF)) - 1))];
+    }
+    take_bits(s, entry & 0xFF);
+    return entry;
+}
+// Reads the code lengths of a dynamic block (RFC 1951 3.2.7) and builds both tables
+int read_dynamic_tables(inflate_state_t *s)
+{
+    static const unsigned char precode_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    refill_bits(s);
+    unsigned int litlen_count = take_bits(s, 5) + 257;
+    unsigned int distance_count = take_bits(s, 5) + 1;
+    unsigned int precode_count = take_bits(s, 4) + 4;
+    if (litlen_count > 286 || distance_count > 30)
+    {
+        return -1;
+    }
+
+    unsigned char precode_lengths[19] = {0};
+    for (unsigned int i = 0; i < precode_count; i++)
+    {
+        if (i % 8 == 0)
+        {
+            refill_bits(s); // 19 * 3 bits do not fit into one refill
+        }
+        precode_lengths[precode_order[i]] = (unsigned char)take_bits(s, 3);
+    }
+    uint32_t precode_entries[19];
+    uint32_t precode[1 << PRECODE_TABLE_BITS];
+    for (unsigned int i = 0; i < 19; i++)
+    {
+        precode_entries[i] = DECODE_ENTRY(i, DECODE_LITERAL, 0);
+    }
+    if (build_decode_table(precode, precode_lengths, 19, precode_entries, PRECODE_TABLE_BITS, 0) != 0)
+    {
+        return -1;
+    }
+
+    // Literal/length and distance lengths form one sequence; repeats may cross from one to the other
+    unsigned char lengths[286 + 30];
+    unsigned int total = litlen_count + distance_count;
+    for (unsigned int i = 0; i < total;)
+    {
+        refill_bits(s);
+        uint32_t entry = precode[s->bits & ((1 << PRECODE_TABLE_BITS) - 1)];
+        if (DECODE_KIND(entry) == DECODE_INVALID)
+        {
+            return -1;
+        }
+        take_bits(s, entry & 0xFF);
+        unsigned int symbol = entry >> 16;
+
+        if (symbol < 16)
+        {
+            lengths[i++] = (unsigned char)symbol;
+            continue;
+        }
+        unsigned char value = 0;
+        unsigned int repeat;
+        if (symbol == 16)
+        {
+            if (i == 0)
+            {
+                return -1;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + take_bits(s, 2);
+        }
+        else if (symbol == 17)
+        {
+            repeat = 3 + take_bits(s, 3);
+        }
+        else
+        {
+            repeat = 11 + take_bits(s, 7);
+        }
+        if (repeat > total - i)
+        {
+            return -1;
+        }
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if (lengths[256] == 0)
+    {
+        return -1; // no end-of-block code
+    }
+
+    if (build_litlen_table(s->litlen, lengths, litlen_count) != 0 ||
+        build_distance_table(s->distance, lengths + litlen_count, distance_count) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+// Fixed codes of block type 1 (RFC 1951 3.2.6)
+int build_fixed_tables(inflate_state_t *s)
+{
+    unsigned char lengths[288 + 32];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    memset(lengths + 288, 5, 32);
+    if (build_litlen_table(s->litlen, lengths, 288) != 0 || build_distance_table(s->distance, lengths + 288, 32) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+// Copies a match whose source may overlap the destination
+static PNG_ALWAYS_INLINE void copy_match(unsigned char *out, size_t distance, size_t length, size_t room)
+{
+    const unsigned char *src = out - distance;
+    // Whole chunks may write up to 15 bytes past the match; they are overwritten later
+    if (room >= length + 16)
+    {
+        unsigned char *end = out + length;
+        if (distance >= 16)
+        {
+            do
+            {
+                memcpy(out, src, 16);
+                out += 16;
+                src += 16;
+            } while (out < end);
+            return;
+        }
+        if (distance >= 8)
+        {
+            do
+            {
+                memcpy(out, src, 8);
+                out += 8;
+                src += 8;
+            } while (out < end);
+            return;
+        }
+        if (distance == 1)
+        {
+            memset(out, *src, length);
+            return;
+        }
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        out[i] = src[i];
+    }
+}
+/* Raw DEFLATE from the input set with set_input into out, with s as scratch
+   for the tables, starting at the current input position. On return the input
+   is positioned at the first byte after the final block; *out_written is the
+   number of bytes produced.
+   Returns -1 for a corrupt stream or one that does not fit into out. */
+int builtin_inflate(inflate_state_t *s, unsigned char *out, size_t out_size, size_t *out_written)
+{
+    s->bits = 0;
+    s->bit_count = 0;
+    s->overrun = 0;
+
+    unsigned char *out_next = out;
+    unsigned char *out_end = out + out_size;
+    int final_block = 0;
+    int fixed_tables = 0; // s->litlen/s->distance currently hold the fixed codes
+
+    while (!final_block)
+    {
+        refill_bits(s);
+        final_block = (int)take_bits(s, 1);
+        unsigned int type = take_bits(s, 2);
+
+        if (type == 0)
+        {
+            // Stored: skip to the byte boundary, give back the whole bytes still in the bit buffer
+            take_bits(s, s->bit_count & 7);
+            if (s->overrun > s->bit_count / 8)
+            {
+                goto corrupt;
+            }
+            rewind_input(s, input_position(s) - (s->bit_count / 8 - s->overrun));
+            s->bits = 0;
+            s->bit_count = 0;
+            s->overrun = 0;
+            unsigned char header[4];
+            if (read_input(s, header, 4) != 0)
+            {
+                goto corrupt;
+            }
+            size_t length = header[0] | (header[1] << 8);
+            size_t check = header[2] | (header[3] << 8);
+            if (length != (~check & 0xFFFF) || length > (size_t)(out_end - out_next) || read_input(s, out_next, length) != 0)
+            {
+                goto corrupt;
+            }
+            out_next += length;
+            continue;
+        }
+        if (type == 1)
+        {
+            if (!fixed_tables && build_fixed_tables(s) != 0)
+            {
+                goto corrupt;
+            }
+            fixed_tables = 1;
+        }
+        else if (type == 2)
+        {
+            if (read_dynamic_tables(s) != 0)
+            {
+                goto corrupt;
+            }
+            fixed_tables = 0;
+        }
+        else
+        {
+            goto corrupt;
+        }
+
+        for (;;)
+        {
+            // One refill covers a literal/length code, its extra bits, a distance code and its extra bits
+            refill_bits(s);
+            uint32_t entry = decode_symbol(s, s->litlen, LITLEN_TABLE_BITS);
+            unsigned int kind = DECODE_KIND(entry);
+
+            if (kind == DECODE_LITERAL)
+            {
+                if (out_next == out_end)
+                {
+                    goto corrupt;
+                }
+                *out_next++ = (unsigned char)(entry >> 16);
+                continue;
+            }
+            if (kind == DECODE_LITERAL2)
+            {
+                if (out_end - out_next < 2)
+                {
+                    goto corrupt;
+                }
+                out_next[0] = (unsigned char)(entry >> 16);
+                out_next[1] = (unsigned char)(entry >> 24);
+                out_next += 2;
+                continue;
+            }
+            if (kind == DECODE_END)
+            {
+                break;
+            }
+            if (kind != DECODE_LENGTH)
+            {
+                goto corrupt;
+            }
+
+            size_t length = (entry >> 16) + take_bits(s, (entry >> 8) & 0xF);
+            entry = decode_symbol(s, s->distance, DISTANCE_TABLE_BITS);
+            if (DECODE_KIND(entry) != DECODE_LENGTH)
+            {
+                goto corrupt;
+            }
+            size_t distance = (entry >> 16) + take_bits(s, (entry >> 8) & 0xF);
+
+            size_t room = (size_t)(out_end - out_next);
+            if (distance > (size_t)(out_next - out) || length > room)
+            {
+                goto corrupt;
+            }
+            copy_match(out_next, distance, length, room);
+            out_next += length;
+        }
+        if (s->overrun > s->bit_count / 8)
+        {
+            goto corrupt; // the stream used bits from past the end of the input
+        }
+    }
+
+    // Whole bytes left in the bit buffer were read ahead and belong to the trailer
+    rewind_input(s, input_position(s) - (s->bit_count / 8 - s->overrun));
+    *out_written = (size_t)(out_next - out);
+    return 0;
+
+corrupt:
+    return -1;
+}
+// adler32 (RFC 1950), so the builtin backend does not need zlib for the checksum either
+uint32_t builtin_adler32(const unsigned char *data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while (size > 0)
+    {
+        // 5552: the most bytes before b can overflow 32 bits
+        size_t block = size < 5552 ? size : 5552;
+        size -= block;
+        for (; block >= 4; block -= 4, data += 4)
+        {
+            a += data[0];
+            b += a;
+            a += data[1];
+            b += a;
+            a += data[2];
+            b += a;
+            a += data[3];
+            b += a;
+        }
+        for (; block > 0; block--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+// zlib stream (RFC 1950) from the input set with set_input: 2-byte header, raw DEFLATE, big-endian adler32 of the output
+int builtin_zlib_decompress(inflate_state_t *s, unsigned char *out, size_t out_size, size_t *out_written)
+{
+    unsigned char in[2];
+    if (read_input(s, in, 2) != 0 || (in[0] & 0x0F) != 8 || (in[0] >> 4) > 7 || ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 0x20))
+    {
+        fprintf(stderr, "Invalid zlib header in IDAT data\n");
+        return -1;
+    }
+
+    if (builtin_inflate(s, out, out_size, out_written) != 0)
+    {
+        fprintf(stderr, "Corrupt DEFLATE data in IDAT\n");
+        return -1;
+    }
+    unsigned char trailer[4];
+    if (read_input(s, trailer, 4) != 0)
+    {
+        fprintf(stderr, "IDAT data ends inside the adler32 checksum\n");
+        return -1;
+    }
+    uint32_t expected = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) | ((uint32_t)trailer[2] << 8) | trailer[3];
+    if (builtin_adler32(out, *out_written) != expected)
+    {
+        fprintf(stderr, "IDAT adler32 mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+#pragma endregion
+#pragma region Inflate backends
+/* Every decode path inflates through an inflate_backend_t, so zlib can be
+   swapped for zlib-ng, libdeflate or the builtin decoder without touching
+   the decode loops:
+   - init creates a state for a zlib stream, or a raw DEFLATE stream when raw
+     is set (the later iDOT segments), in the given arena;
+   - feed inflates from io->next_in to io->next_out and advances both; it
+     returns INFLATE_MORE while the stream has not ended;
+   - reset prepares the state for the next stream;
+   - finish releases whatever the state holds outside the arena; the state
+     itself goes with the arena.
+   Whole-buffer backends (libdeflate, builtin) cannot resume: feed gets the
+   complete stream and the complete output buffer in one call, so only
+   decompress_IDAT can use them, and the row-by-row paths go through it.
+   The builtin decoder reads the IDAT chunks where they lie (reads_spans);
+   libdeflate needs one buffer, so several chunks are joined for it.
+   The backend is chosen with --inflate or the PNG_DECODER_INFLATE
+   environment variable; zlib is the default. */
+// zlib allocates its state and window through the arena as well
+void *zlib_backend_init(int raw, png_arena_t *arena)
+{
+    z_stream *stream = (z_stream *)png_arena_alloc(arena, sizeof(z_stream));
+    if (!stream)
+    {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->zalloc = png_arena_zalloc;
+    stream->zfree = png_arena_zfree;
+    stream->opaque = arena;
+    if ((raw ? inflateInit2(stream, -MAX_WBITS) : inflateInit(stream)) != Z_OK)
+    {
+        return NULL;
+    }
+    return stream;
+}
+int zlib_backend_feed(void *state, inflate_io_t *io)
+{
+    z_stream *stream = (z_stream *)state;
+    // avail_in/avail_out are 32-bit: feed at most 1 GB at a time
+    uInt in_size = io->avail_in < (1u << 30) ? (uInt)io->avail_in : (1u << 30);
+    uInt out_size = io->avail_out < (1u << 30) ? (uInt)io->avail_out : (1u << 30);
+    stream->next_in = (Bytef *)io->next_in;
+    stream->avail_in = in_size;
+    stream->next_out = io->next_out;
+    stream->avail_out = out_size;
+
+    int ret = inflate(stream, Z_NO_FLUSH);
+
+    io->next_in += in_size - stream->avail_in;
+    io->avail_in -= in_size - stream->avail_in;
+    io->next_out += out_size - stream->avail_out;
+    io->avail_out -= out_size - stream->avail_out;
+    if (ret == Z_STREAM_END)
+    {
+        return INFLATE_END;
+    }
+    if (ret != Z_OK)
+    {
+        fprintf(stderr, "zlib inflate error %d%s%s\n", ret, stream->msg ? ": " : "", stream->msg ? stream->msg : "");
+        return INFLATE_ERROR;
+    }
+    return INFLATE_MORE;
+}
+int zlib_backend_reset(void *state)
+{
+    return inflateReset((z_stream *)state) == Z_OK ? 0 : -1;
+}
+void zlib_backend_finish(void *state)
+{
+    inflateEnd((z_stream *)state);
+}
+const inflate_backend_t zlib_backend = {"zlib", 0, 0, zlib_backend_init, zlib_backend_feed, zlib_backend_reset, zlib_backend_finish};
+
+#ifdef HAVE_ZLIB_NG
+// zlib-ng's native API: the zlib calls with a zng_ prefix
+void *zlib_ng_backend_init(int raw, png_arena_t *arena)
+{
+    zng_stream *stream = (zng_stream *)png_arena_alloc(arena, sizeof(zng_stream));
+    if (!stream)
+    {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->zalloc = png_arena_zalloc;
+    stream->zfree = png_arena_zfree;
+    stream->opaque = arena;
+    if ((raw ? zng_inflateInit2(stream, -MAX_WBITS) : zng_inflateInit(stream)) != Z_OK)
+    {
+        return NULL;
+    }
+    return stream;
+}
+int zlib_ng_backend_feed(void *state, inflate_io_t *io)
+{
+    zng_stream *stream = (zng_stream *)state;
+    uint32_t in_size = io->avail_in < (1u << 30) ? (uint32_t)io->avail_in : (1u << 30);
+    uint32_t out_size = io->avail_out < (1u << 30) ? (uint32_t)io->avail_out : (1u << 30);
+    stream->next_in = io->next_in;
+    stream->avail_in = in_size;
+    stream->next_out = io->next_out;
+    stream->avail_out = out_size;
+
+    int ret = zng_inflate(stream, Z_NO_FLUSH);
+
+    io->next_in += in_size - stream->avail_in;
+    io->avail_in -= in_size - stream->avail_in;
+    io->next_out += out_size - stream->avail_out;
+    io->avail_out -= out_size - stream->avail_out;
+    if (ret == Z_STREAM_END)
+    {
+        return INFLATE_END;
+    }
+    if (ret != Z_OK)
+    {
+        fprintf(stderr, "zlib-ng inflate error %d%s%s\n", ret, stream->msg ? ": " : "", stream->msg ? stream->msg : "");
+        return INFLATE_ERROR;
+    }
+    return INFLATE_MORE;
+}
+int zlib_ng_backend_reset(void *state)
+{
+    return zng_inflateReset((zng_stream *)state) == Z_OK ? 0 : -1;
+}
+void zlib_ng_backend_finish(void *state)
+{
+    zng_inflateEnd((zng_stream *)state);
+}
+const inflate_backend_t zlib_ng_backend = {"zlib-ng", 0, 0, zlib_ng_backend_init, zlib_ng_backend_feed, zlib_ng_backend_reset, zlib_ng_backend_finish};
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+typedef struct libdeflate_backend_state
+{
+    struct libdeflate_decompressor *decompressor;
+    int raw;
+} libdeflate_backend_state_t;
+
+// libdeflate's allocator hooks are process-wide and take no context, so the
+// decompressor itself stays on the heap
+void *libdeflate_backend_init(int raw, png_arena_t *arena)
+{
+    libdeflate_backend_state_t *state = (libdeflate_backend_state_t *)png_arena_alloc(arena, sizeof(libdeflate_backend_state_t));
+    if (!state)
+    {
+        return NULL;
+    }
+    state->decompressor = libdeflate_alloc_decompressor();
+    state->raw = raw;
+    if (!state->decompressor)
+    {
+        return NULL;
+    }
+    return state;
+}
+int libdeflate_backend_feed(void *state, inflate_io_t *io)
+{
+    libdeflate_backend_state_t *s = (libdeflate_backend_state_t *)state;
+    size_t in_used = 0, out_written = 0;
+    enum libdeflate_result result =
+        s->raw ? libdeflate_deflate_decompress_ex(s->decompressor, io->next_in, io->avail_in, io->next_out, io->avail_out, &in_used, &out_written)
+               : libdeflate_zlib_decompress_ex(s->decompressor, io->next_in, io->avail_in, io->next_out, io->avail_out, &in_used, &out_written);
+    if (result != LIBDEFLATE_SUCCESS)
+    {
+        fprintf(stderr, "libdeflate error %d\n", (int)result);
+        return INFLATE_ERROR;
+    }
+    io->next_in += in_used;
+    io->avail_in -= in_used;
+    io->next_out += out_written;
+    io->avail_out -= out_written;
+    return INFLATE_END;
+}
+int libdeflate_backend_reset(void *state)
+{
+    (void)state; // nothing carries over between calls
+    return 0;
+}
+void libdeflate_backend_finish(void *state)
+{
+    libdeflate_free_decompressor(((libdeflate_backend_state_t *)state)->decompressor);
+}
+const inflate_backend_t libdeflate_backend = {"libdeflate", 1, 0, libdeflate_backend_init, libdeflate_backend_feed, libdeflate_backend_reset, libdeflate_backend_finish};
+#endif
+
+// The builtin decoder keeps nothing between calls: the state is the table scratch and whether the stream is raw
+typedef struct builtin_backend_state
+{
+    inflate_state_t scratch;
+    int raw;
+} builtin_backend_state_t;
+
+void *builtin_backend_init(int raw, png_arena_t *arena)
+{
+    builtin_backend_state_t *state = (builtin_backend_state_t *)png_arena_alloc(arena, sizeof(builtin_backend_state_t));
+    if (state)
+    {
+        state->raw = raw;
+    }
+    return state;
+}
+// Reads io->spans in place when given, next_in otherwise (then as a single span)
+int builtin_backend_feed(void *state, inflate_io_t *io)
+{
+    builtin_backend_state_t *s = (builtin_backend_state_t *)state;
+    IDAT_span_t whole = {0, io->avail_in};
+    if (io->spans)
+    {
+        set_input(&s->scratch, io->span_base, io->spans, io->span_count);
+    }
+    else
+    {
+        set_input(&s->scratch, io->next_in, &whole, 1);
+    }
+    size_t out_written = 0;
+    int ret = s->raw ? builtin_inflate(&s->scratch, io->next_out, io->avail_out, &out_written)
+                     : builtin_zlib_decompress(&s->scratch, io->next_out, io->avail_out, &out_written);
+    if (ret != 0)
+    {
+        return INFLATE_ERROR;
+    }
+    if (!io->spans)
+    {
+        size_t in_used = input_position(&s->scratch);
+        io->next_in += in_used;
+        io->avail_in -= in_used;
+    }
+    io->next_out += out_written;
+    io->avail_out -= out_written;
+    return INFLATE_END;
+}
+int builtin_backend_reset(void *state)
+{
+    (void)state;
+    return 0;
+}
+void builtin_backend_finish(void *state)
+{
+    (void)state; // nothing outside the arena
+}
+const inflate_backend_t builtin_backend = {"builtin", 1, 1, builtin_backend_init, builtin_backend_feed, builtin_backend_reset, builtin_backend_finish};
+
+// Backends compiled into this build, the default first
+const inflate_backend_t *inflate_backends[] = {
+    &zlib_backend,
+#ifdef HAVE_ZLIB_NG
+    &zlib_ng_backend,
+#endif
+#ifdef HAVE_LIBDEFLATE
+    &libdeflate_backend,
+#endif
+    &builtin_backend,
+};
+const inflate_backend_t *active_inflate_backend = &zlib_backend;
+static png_once_t inflate_backend_once = PNG_ONCE_INIT;
+
+const inflate_backend_t *find_inflate_backend(const char *name)
+{
+    for (size_t i = 0; i < sizeof(inflate_backends) / sizeof(inflate_backends[0]); i++)
+    {
+        if (strcmp(name, inflate_backends[i]->name) == 0)
+        {
+            return inflate_backends[i];
+        }
+    }
+    fprintf(stderr, "Unknown inflate backend: %s (available:", name);
+    for (size_t i = 0; i < sizeof(inflate_backends) / sizeof(inflate_backends[0]); i++)
+    {
+        fprintf(stderr, " %s", inflate_backends[i]->name);
+    }
+    fprintf(stderr, ")\n");
+    return NULL;
+}
+// Runs once, through png_call_once: PNG_DECODER_INFLATE is applied before any caller returns from init_inflate_backend
+static void setup_inflate_backend(void)
+{
+    const char *forced = getenv("PNG_DECODER_INFLATE");
+    if (forced && *forced)
+    {
+        const inflate_backend_t *backend = find_inflate_backend(forced);
+        if (backend)
+        {
+            active_inflate_backend = backend;
+        }
+    }
+}
+// Safe to call from any thread, any number of times
+void init_inflate_backend(void)
+{
+    png_call_once(&inflate_backend_once, setup_inflate_backend);
+}
+// Not thread safe: call before starting to decode
+int png_set_inflate_backend(const char *name)
+{
+    init_inflate_backend(); // an explicit choice wins over the environment
+    const inflate_backend_t *backend = find_inflate_backend(name);
+    if (!backend)
+    {
+        return -1;
+    }
+    active_inflate_backend = backend;
+    return 0;
+}
+const inflate_backend_t *png_get_inflate_backend(void)
+{
+    return active_inflate_backend;
+}
+int inflater_init(inflater_t *inflater, const inflate_backend_t *backend, int raw, png_arena_t *arena)
+{
+    memset(inflater, 0, sizeof(*inflater));
+    inflater->backend = backend;
+    inflater->state = backend->init(raw, arena);
+    if (!inflater->state)
+    {
+        fprintf(stderr, "Failed to initialize %s for decompression.\n", backend->name);
+        return -1;
+    }
+    inflater->status = INFLATE_MORE;
+    return 0;
+}
+void inflater_end(inflater_t *inflater)
+{
+    if (inflater->state)
+    {
+        inflater->backend->finish(inflater->state);
+        inflater->state = NULL;
+    }
+}
+// libdeflate needs the zlib stream in one piece: a single IDAT chunk is used in place, several are joined
+const unsigned char *join_IDAT(PNG_decoder_t *decoder)
+{
+    if (decoder->idat_count == 0)
+    {
+        fprintf(stderr, "No IDAT data\n");
+        return NULL;
+    }
+    if (decoder->idat_count == 1)
+    {
+        return decoder->data + decoder->idat_spans[0].offset;
+    }
+
+    unsigned char *joined = (unsigned char *)png_arena_alloc(&decoder->arena, decoder->idat_size);
+    if (!joined)
+    {
+        fprintf(stderr, "Failed to allocate memory for IDAT data.\n");
+        return NULL;
+    }
+    size_t joined_size = 0;
+    for (size_t i = 0; i < decoder->idat_count; i++)
+    {
+        memcpy(joined + joined_size, decoder->data + decoder->idat_spans[i].offset, decoder->idat_spans[i].size);
+        joined_size += decoder->idat_spans[i].size;
+    }
+    return joined;
+}
+#pragma endregion
+#pragma region Filters
+/* All filters share one signature so they can sit in the dispatch table
+   (see Filter dispatch); prev_scanline is NULL on the first row.
+
+   The loops are written once as always-inline bodies that walk the row pixel
+   by pixel with an inner loop over the pixel's bytes. The generic filters below
+   call them with the runtime bytes_per_pixel; SCALAR_FILTER_KERNELS stamps out
+   one copy per pixel size where that size is a constant, so the compiler
+   unrolls the inner loop and keeps the channels independent. The dispatch
+   table picks the copy for the image once, from the IHDR. */
+static PNG_ALWAYS_INLINE void sub_filter_body(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width)
+{
+    if (width == 0)
+    {
+        return;
+    }
+    // First pixel has no left neighbour
+    for (size_t c = 0; c < bytes_per_pixel; c++)
+    {
+        output[c] = scanline[c];
+    }
+    for (size_t i = bytes_per_pixel; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        for (size_t c = 0; c < bytes_per_pixel; c++)
+        {
+            output[i + c] = scanline[i + c] + output[i + c - bytes_per_pixel];
+        }
+    }
+}
+static PNG_ALWAYS_INLINE void average_filter_body(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    if (width == 0)
+    {
+        return;
+    }
+    for (size_t c = 0; c < bytes_per_pixel; c++)
+    {
+        output[c] = scanline[c] + (prev_scanline[c] >> 1);
+    }
+    for (size_t i = bytes_per_pixel; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        for (size_t c = 0; c < bytes_per_pixel; c++)
+        {
+            output[i + c] = scanline[i + c] + ((output[i + c - bytes_per_pixel] + prev_scanline[i + c]) >> 1);
+        }
+    }
+}
+static PNG_ALWAYS_INLINE void average_filter_first_row_body(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t width)
+{
+    if (width == 0)
+    {
+        return;
+    }
+    for (size_t c = 0; c < bytes_per_pixel; c++)
+    {
+        output[c] = scanline[c];
+    }
+    for (size_t i = bytes_per_pixel; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        for (size_t c = 0; c < bytes_per_pixel; c++)
+        {
+            output[i + c] = scanline[i + c] + (output[i + c - bytes_per_pixel] >> 1);
+        }
+    }
+}
+static PNG_ALWAYS_INLINE void paeth_filter_body(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    if (width == 0)
+    {
+        return;
+    }
+    // First pixel: left and upper_left are 0, so the predictor is up
+    for (size_t c = 0; c < bytes_per_pixel; c++)
+    {
+        output[c] = scanline[c] + prev_scanline[c];
+    }
+    for (size_t i = bytes_per_pixel; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        for (size_t c = 0; c < bytes_per_pixel; c++)
+        {
+            unsigned char predicted = paeth_predictor(output[i + c - bytes_per_pixel], prev_scanline[i + c], prev_scanline[i + c - bytes_per_pixel]);
+            output[i + c] = scanline[i + c] + predicted;
+        }
+    }
+}
+
+void no_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    memmove(output, scanline, width * bytes_per_pixel); // output may overlap scanline (apply_filters_in_place)
+}
+void sub_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    sub_filter_body(output, scanline, bytes_per_pixel, width);
+}
+// Sub from byte `start` on: used for the bytes a SIMD kernel leaves over
+void sub_filter_from(unsigned char *output, unsigned char *scanline, size_t bytes_per_pixel, size_t start, size_t size)
+{
+    size_t x = start;
+    for (; x < bytes_per_pixel && x < size; x++)
+    {
+        output[x] = scanline[x];
+    }
+    for (; x < size; x++)
+    {
+        output[x] = scanline[x] + output[x - bytes_per_pixel];
+    }
+}
+void up_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    if (prev_scanline == NULL)
+    {
+        no_filter(output, scanline, NULL, bytes_per_pixel, width);
+        return;
+    }
+    for (size_t x = 0; x < width * bytes_per_pixel; x++)
+    {
+        output[x] = scanline[x] + prev_scanline[x];
+    }
+}
+void average_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    // reconstructed = raw + ((left + up) / 2)
+
+    if (prev_scanline == NULL)
+    {
+        average_filter_first_row(output, scanline, NULL, bytes_per_pixel, width);
+        return;
+    }
+    average_filter_body(output, scanline, prev_scanline, bytes_per_pixel, width);
+}
+// First row of the image (or of an interlace pass): up is 0, so only half of left is added
+void average_filter_first_row(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    average_filter_first_row_body(output, scanline, bytes_per_pixel, width);
+}
+unsigned char paeth_predictor(unsigned char left, unsigned char up, unsigned char upper_left)
+{
+    // The prediction minimizes the sum of absolute differences between the actual value and the three neighbors.
+    // With p = left + up - upper_left the three differences simplify to:
+    int pa = abs(up - upper_left);              // |p - left|
+    int pb = abs(left - upper_left);            // |p - up|
+    int pc = abs(left + up - 2 * upper_left);   // |p - upper_left|
+
+    // Return the neighbor (left, up, or upper_left) with the smallest difference (pa, pb, pc),
+    // ties in that order. Selected with masks instead of branches: the outcome is data dependent
+    // and mispredicts on almost every byte of a photographic image.
+    int not_left = -((pa > pb) | (pa > pc));
+    int use_upper_left = -(pb > pc);
+    int up_or_upper_left = (upper_left & use_upper_left) | (up & ~use_upper_left);
+    return (unsigned char)((up_or_upper_left & not_left) | (left & ~not_left));
+}
+void paeth_filter(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    // reconstructed = raw + predicted
+
+    // Without a previous row up and upper_left are 0 and the predictor always picks left: that is Sub
+    if (prev_scanline == NULL)
+    {
+        sub_filter(output, scanline, NULL, bytes_per_pixel, width);
+        return;
+    }
+    paeth_filter_body(output, scanline, prev_scanline, bytes_per_pixel, width);
+}
+
+// One set of scalar kernels per pixel size, BPP is a compile-time constant in each
+#define SCALAR_FILTER_KERNELS(BPP)                                                                                                                             \
+    void sub_filter_bpp##BPP(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)               \
+    {                                                                                                                                                          \
+        (void)prev_scanline, (void)bytes_per_pixel;                                                                                                            \
+        sub_filter_body(output, scanline, BPP, width);                                                                                                         \
+    }                                                                                                                                                          \
+    void average_filter_bpp##BPP(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)           \
+    {                                                                                                                                                          \
+        (void)bytes_per_pixel;                                                                                                                                 \
+        average_filter_body(output, scanline, prev_scanline, BPP, width);                                                                                      \
+    }                                                                                                                                                          \
+    void average_filter_first_row_bpp##BPP(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width) \
+    {                                                                                                                                                          \
+        (void)prev_scanline, (void)bytes_per_pixel;                                                                                                            \
+        average_filter_first_row_body(output, scanline, BPP, width);                                                                                           \
+    }                                                                                                                                                          \
+    void paeth_filter_bpp##BPP(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)             \
+    {                                                                                                                                                          \
+        (void)bytes_per_pixel;                                                                                                                                 \
+        paeth_filter_body(output, scanline, prev_scanline, BPP, width);                                                                                        \
+    }
+SCALAR_FILTER_KERNELS(1)
+SCALAR_FILTER_KERNELS(2)
+SCALAR_FILTER_KERNELS(3)
+SCALAR_FILTER_KERNELS(4)
+SCALAR_FILTER_KERNELS(6)
+SCALAR_FILTER_KERNELS(8)
+
+size_t get_bytes_per_pixel(PNG_decoder_t *decoder)
+{
+    /*Calculate the number of bytes per pixel based on the bit depth and color type.
+        decoder->bit_depth <= 8: one byte per channel, otherwise two (16-bit samples).
+        The channel count follows from the color type (gray, RGB, palette index, gray+alpha, RGBA).
+
+     Bit depths below 8 pack several pixels into one byte. The filters then work on
+     the previous byte (the spec rounds up to 1), so 1 is returned for those as well,
+     and get_row_size gives the packed size of a row.
+     A depth the color type does not allow gives 0, like an unknown color type. */
+    if (valid_bit_depth(decoder->color_type, 8) && !valid_bit_depth(decoder->color_type, decoder->bit_depth)) // every known color type allows 8
+    {
+        fprintf(stderr, "Unsupported bit depth %u for color type %u\n", decoder->bit_depth, decoder->color_type);
+        return 0;
+    }
+    switch (decoder->color_type)
+    {
+    case 0: // Grayscale
+        return (decoder->bit_depth <= 8) ? 1 : 2;
+    case 2: // Truecolor (RGB)
+        return (decoder->bit_depth <= 8) ? 3 : 6;
+    case 3: // Indexed-color (palette)
+        return 1; // Always 1 byte per pixel (index in palette)
+    case 4: // Grayscale + Alpha
+        return (decoder->bit_depth <= 8) ? 2 : 4;
+    case 6: // Truecolor + Alpha (RGBA)
+        return (decoder->bit_depth <= 8) ? 4 : 8;
+    default:
+        fprintf(stderr, "Unsupported color type: %u\n", decoder->color_type);
+        return 0;
+    }
+}
+// Kernels for one pixel size, picked once per image
+const unfilter_fn_t *select_filter_kernels(size_t bytes_per_pixel)
+{
+    return filter_kernels[bytes_per_pixel];
+}
+// Bytes of one reconstructed row, without the filter byte
+size_t get_row_size(PNG_decoder_t *decoder, size_t bytes_per_pixel)
+{
+    return get_packed_row_size(decoder->width, decoder->bit_depth, bytes_per_pixel);
+}
+// Same for a row of width pixels of any image (or Adam7 pass): samples below 8 bits are packed, rows end on a byte
+size_t get_packed_row_size(size_t width, unsigned int bit_depth, size_t bytes_per_pixel)
+{
+    // Only gray and palette images (one channel) allow bit depths below 8
+    return bit_depth < 8 ? (width * bit_depth + 7) / 8 : width * bytes_per_pixel;
+}
+// row_size is in bytes: the kernels see a packed row as row_size one-byte pixels
+int unfilter_scanline(const unfilter_fn_t *kernels, unsigned char filter_type, unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t row_size)
+{
+    // On the first row up and upper_left read as 0: Up is then None, Paeth is Sub
+    // and Average has its own kernel, so the table kernels never see a NULL prev_scanline.
+    static const unsigned char first_row_kernel[5] = {FILTER_KERNEL_NONE, FILTER_KERNEL_SUB, FILTER_KERNEL_NONE,
+                                                      FILTER_KERNEL_AVERAGE_FIRST_ROW, FILTER_KERNEL_SUB};
+    if (filter_type > 4)
+    {
+        fprintf(stderr, "Unsupported filter type: %u\n", filter_type);
+        return -1;
+    }
+
+    unsigned char kernel = prev_scanline ? filter_type : first_row_kernel[filter_type];
+    kernels[kernel](output, scanline, prev_scanline, bytes_per_pixel, row_size / bytes_per_pixel);
+    return 0;
+}
+unsigned char *apply_filters(PNG_decoder_t *decoder, unsigned char *decompressed_data)
+{
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return NULL;
+    }
+
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, get_row_size(decoder, bytes_per_pixel) * decoder->height);
+    if (!output)
+    {
+        fprintf(stderr, "Failed to allocate memory for filtered image.\n");
+        return NULL;
+    }
+
+    if (unfilter_image(decoder, decompressed_data, output, bytes_per_pixel) != 0)
+    {
+        return NULL;
+    }
+    return output;
+}
+/* The inflated buffer already holds the image plus one filter byte per row, so
+   a second full-size allocation is not needed: row y is reconstructed over the
+   buffer itself at y * row_size, i.e. shifted y + 1 bytes left of where its
+   filtered bytes start. That is always at or before the bytes still to be read
+   (the kernels load a chunk before storing it) and after the previous row,
+   which is already final, so every kernel works unchanged.
+   The result is a view into decompressed_data. With compact set the buffer is
+   shrunk to the image size afterwards, releasing the tail that held the filter bytes. */
+unsigned char *apply_filters_in_place(PNG_decoder_t *decoder, unsigned char *decompressed_data, int compact)
+{
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return NULL;
+    }
+
+    if (unfilter_image(decoder, decompressed_data, decompressed_data, bytes_per_pixel) != 0)
+    {
+        return NULL;
+    }
+
+    if (compact)
+    {
+        size_t row_size = get_row_size(decoder, bytes_per_pixel);
+        unsigned char *shrunk = (unsigned char *)png_arena_realloc(&decoder->arena, decompressed_data, (row_size + 1) * decoder->height, row_size * decoder->height);
+        if (shrunk) // if realloc fails the larger buffer is still valid
+        {
+            decompressed_data = shrunk;
+        }
+    }
+    return decompressed_data;
+}
+// Unfilters every row of decompressed_data into output; output may be decompressed_data itself
+int unfilter_image(PNG_decoder_t *decoder, unsigned char *decompressed_data, unsigned char *output, size_t bytes_per_pixel)
+{
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+    return unfilter_rows(select_filter_kernels(bytes_per_pixel), decompressed_data, output, bytes_per_pixel, get_row_size(decoder, bytes_per_pixel), decoder->height, decoder->filter_counts);
+}
+// The loop of unfilter_image for any block of rows (an Adam7 pass); adds to filter_counts
+int unfilter_rows(const unfilter_fn_t *kernels, unsigned char *filtered, unsigned char *output, size_t bytes_per_pixel, size_t row_size, size_t height, size_t filter_counts[5])
+{
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    unsigned char *prev_scanline = NULL;
+    unsigned char *current_output = output;
+
+    for (size_t y = 0; y < height; y++)
+    {
+        unsigned char filter_type = filtered[y * scanline_size];
+        unsigned char *scanline = filtered + y * scanline_size + 1;
+
+        if (unfilter_scanline(kernels, filter_type, current_output, scanline, prev_scanline, bytes_per_pixel, row_size) != 0)
+        {
+            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, y);
+            return -1;
+        }
+        filter_counts[filter_type]++;
+
+        prev_scanline = current_output;
+        current_output += row_size;
+    }
+
+    return 0;
+}
+#pragma endregion
+#pragma region SIMD filters
+/* Sub reconstruction is a running sum along the row with a stride of
+   bytes_per_pixel: out[i] = raw[i] + out[i - bpp].
+   Inside a register the sum over the pixels of one load is done with
+   byte-shifted adds (log2(pixels) steps), then the last reconstructed pixel of
+   the previous load, replicated over every pixel slot, is added on top.
+   bpp 3 and 6 do not divide 16, so those kernels step 12 bytes per load and
+   store exactly 12 bytes: the next 4 input bytes may share memory with the
+   output when a row is reconstructed in place.
+   Loads are 16 (32) bytes wide, the loops stop early enough that they never
+   read past the end of the scanline; the leftover bytes go through sub_filter_from. */
+#if PNG_SIMD_X86
+static inline void store_12_bytes(unsigned char *output, __m128i x)
+{
+    _mm_storel_epi64((__m128i *)output, x);
+    uint32_t high = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+    memcpy(output + 8, &high, 4);
+}
+void sub_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    const __m128i pixel_mask = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i left = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 12)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+        x = _mm_add_epi8(x, left);
+        store_12_bytes(output + i, x);
+
+        // replicate pixel 3 (bytes 9..11) into pixel slots 0..3
+        left = _mm_and_si128(_mm_srli_si128(x, 9), pixel_mask);
+        left = _mm_or_si128(left, _mm_slli_si128(left, 3));
+        left = _mm_or_si128(left, _mm_slli_si128(left, 6));
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+void sub_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    __m128i left = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, left);
+        _mm_storeu_si128((__m128i *)(output + i), x);
+
+        left = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+void sub_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    const __m128i pixel_mask = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i left = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 12)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+        x = _mm_add_epi8(x, left);
+        store_12_bytes(output + i, x);
+
+        left = _mm_and_si128(_mm_srli_si128(x, 6), pixel_mask);
+        left = _mm_or_si128(left, _mm_slli_si128(left, 6));
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+void sub_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    __m128i left = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, left);
+        _mm_storeu_si128((__m128i *)(output + i), x);
+
+        left = _mm_unpackhi_epi64(x, x);
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+// Up has no dependency along the row: plain wide adds, any pixel size
+void up_filter_sse2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    size_t size = width * bytes_per_pixel;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+        __m128i up = _mm_loadu_si128((const __m128i *)(prev_scanline + i));
+        _mm_storeu_si128((__m128i *)(output + i), _mm_add_epi8(x, up));
+    }
+    for (; i < size; i++)
+    {
+        output[i] = scanline[i] + prev_scanline[i];
+    }
+}
+/* Paeth has a true left-to-right dependency, so the kernel works one pixel
+   per step and gets its parallelism across the channels instead: the pixel is
+   widened to 16-bit lanes (up to 8 bytes fit in one register), the three
+   distances are computed at once and the predictor is picked with
+   compare/select masks, no branches. */
+// 3- and 6-byte pixels are assembled in general registers: going through a
+// partially written stack slot stalls store forwarding on every pixel.
+static inline __m128i load_pixel_sse2(const unsigned char *p, size_t bytes_per_pixel)
+{
+    uint32_t low = 0;
+    uint16_t high;
+    switch (bytes_per_pixel)
+    {
+    case 3:
+        memcpy(&high, p, 2);
+        return _mm_cvtsi32_si128(high | (p[2] << 16));
+    case 4:
+        memcpy(&low, p, 4);
+        return _mm_cvtsi32_si128((int)low);
+    case 6:
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 2);
+        return _mm_insert_epi16(_mm_cvtsi32_si128((int)low), high, 2);
+    default:
+        return _mm_loadl_epi64((const __m128i *)p);
+    }
+}
+static inline void store_pixel_sse2(unsigned char *p, __m128i x, size_t bytes_per_pixel)
+{
+    uint32_t low = (uint32_t)_mm_cvtsi128_si32(x);
+    uint16_t high;
+    switch (bytes_per_pixel)
+    {
+    case 3:
+        high = (uint16_t)low;
+        memcpy(p, &high, 2);
+        p[2] = (unsigned char)(low >> 16);
+        break;
+    case 4:
+        memcpy(p, &low, 4);
+        break;
+    case 6:
+        high = (uint16_t)_mm_extract_epi16(x, 2);
+        memcpy(p, &low, 4);
+        memcpy(p + 4, &high, 2);
+        break;
+    default:
+        _mm_storel_epi64((__m128i *)p, x);
+        break;
+    }
+}
+static inline __m128i abs_epi16_sse2(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+static inline __m128i select_sse2(__m128i mask, __m128i if_set, __m128i if_clear)
+{
+    return _mm_or_si128(_mm_and_si128(mask, if_set), _mm_andnot_si128(mask, if_clear));
+}
+static inline __m128i paeth_predictor_sse2(__m128i left, __m128i up, __m128i upper_left)
+{
+    __m128i to_left = _mm_sub_epi16(up, upper_left);   // p - left
+    __m128i to_up = _mm_sub_epi16(left, upper_left);   // p - up
+    __m128i pc = abs_epi16_sse2(_mm_add_epi16(to_left, to_up));
+    __m128i pa = abs_epi16_sse2(to_left);
+    __m128i pb = abs_epi16_sse2(to_up);
+
+    __m128i not_left = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i up_or_upper_left = select_sse2(_mm_cmpgt_epi16(pb, pc), upper_left, up);
+    return select_sse2(not_left, up_or_upper_left, left);
+}
+static inline void paeth_filter_sse2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i left = zero, upper_left = zero;
+
+    for (size_t i = 0; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        __m128i up = _mm_unpacklo_epi8(load_pixel_sse2(prev_scanline + i, bytes_per_pixel), zero);
+        __m128i predicted = paeth_predictor_sse2(left, up, upper_left);
+        __m128i x = _mm_add_epi8(load_pixel_sse2(scanline + i, bytes_per_pixel), _mm_packus_epi16(predicted, predicted));
+        store_pixel_sse2(output + i, x, bytes_per_pixel);
+
+        left = _mm_unpacklo_epi8(x, zero);
+        upper_left = up;
+    }
+}
+// The pixel size is a constant in each wrapper, so the pixel loads/stores become fixed-size moves
+void paeth_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    paeth_filter_sse2(output, scanline, prev_scanline, 3, width);
+}
+void paeth_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    paeth_filter_sse2(output, scanline, prev_scanline, 4, width);
+}
+void paeth_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    paeth_filter_sse2(output, scanline, prev_scanline, 6, width);
+}
+void paeth_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    paeth_filter_sse2(output, scanline, prev_scanline, 8, width);
+}
+/* Average: (left + up) / 2 rounds down, _mm_avg_epu8 rounds up, so the kernel
+   subtracts the lost low bit: floor((a + b) / 2) = avg_epu8(a, b) - ((a ^ b) & 1).
+   That keeps everything in 8-bit lanes; like Paeth it steps one pixel at a time. */
+static inline void average_filter_sse2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i left = _mm_setzero_si128();
+
+    for (size_t i = 0; i < width * bytes_per_pixel; i += bytes_per_pixel)
+    {
+        __m128i up = load_pixel_sse2(prev_scanline + i, bytes_per_pixel);
+        __m128i average = _mm_sub_epi8(_mm_avg_epu8(left, up), _mm_and_si128(_mm_xor_si128(left, up), one));
+        __m128i x = _mm_add_epi8(load_pixel_sse2(scanline + i, bytes_per_pixel), average);
+        store_pixel_sse2(output + i, x, bytes_per_pixel);
+
+        left = x;
+    }
+}
+void average_filter_sse2_bpp3(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    average_filter_sse2(output, scanline, prev_scanline, 3, width);
+}
+void average_filter_sse2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    average_filter_sse2(output, scanline, prev_scanline, 4, width);
+}
+void average_filter_sse2_bpp6(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    average_filter_sse2(output, scanline, prev_scanline, 6, width);
+}
+void average_filter_sse2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)bytes_per_pixel;
+    average_filter_sse2(output, scanline, prev_scanline, 8, width);
+}
+#if PNG_SIMD_AVX2
+// AVX2 byte shifts stay inside each 128-bit lane: after the in-lane sums the
+// last pixel of the low lane is moved into the high lane and added there.
+PNG_TARGET_AVX2 void sub_filter_avx2_bpp4(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    __m256i left = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(scanline + i));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+        __m256i low_lane = _mm256_permute2x128_si256(x, x, 0x08); // high lane = low lane of x, low lane = 0
+        x = _mm256_add_epi8(x, _mm256_shuffle_epi32(low_lane, _MM_SHUFFLE(3, 3, 3, 3)));
+        x = _mm256_add_epi8(x, left);
+        _mm256_storeu_si256((__m256i *)(output + i), x);
+
+        left = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+        left = _mm256_permute2x128_si256(left, left, 0x11);
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+PNG_TARGET_AVX2 void sub_filter_avx2_bpp8(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    (void)prev_scanline;
+    size_t size = width * bytes_per_pixel;
+    __m256i left = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(scanline + i));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+        __m256i low_lane = _mm256_permute2x128_si256(x, x, 0x08);
+        x = _mm256_add_epi8(x, _mm256_unpackhi_epi64(low_lane, low_lane));
+        x = _mm256_add_epi8(x, left);
+        _mm256_storeu_si256((__m256i *)(output + i), x);
+
+        left = _mm256_unpackhi_epi64(x, x);
+        left = _mm256_permute2x128_si256(left, left, 0x11);
+    }
+    sub_filter_from(output, scanline, bytes_per_pixel, i, size);
+}
+PNG_TARGET_AVX2 void up_filter_avx2(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    size_t size = width * bytes_per_pixel;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(scanline + i));
+        __m256i up = _mm256_loadu_si256((const __m256i *)(prev_scanline + i));
+        _mm256_storeu_si256((__m256i *)(output + i), _mm256_add_epi8(x, up));
+    }
+    for (; i < size; i++)
+    {
+        output[i] = scanline[i] + prev_scanline[i];
+    }
+}
+PNG_TARGET_AVX512 void up_filter_avx512(unsigned char *output, unsigned char *scanline, unsigned char *prev_scanline, size_t bytes_per_pixel, size_t width)
+{
+    size_t size = width * bytes_per_pixel;
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        __m512i x = _mm512_loadu_si512((const void *)(scanline + i));
+        __m512i up = _mm512_loadu_si512((const void *)(prev_scanline + i));
+        _mm512_storeu_si512((void *)(output + i), _mm512_add_epi8(x, up));
+    }
+    for (; i < size; i++)
+    {
+        output[i] = scanline[i] + prev_scanline[i];
+    }
+}
+#endif
+#endif
+#pragma endregion
+#pragma region Filter dispatch
+/* The CPU is probed once (init_filter_dispatch, called at startup) and the
+   best kernel for every (filter, bytes_per_pixel) pair is written into
+   filter_kernels. Decoders take the row for their pixel size once per image
+   (select_filter_kernels) and unfilter_scanline calls through it, so there is
+   no feature test per row. Entries without a kernel for the selected level
+   keep the best lower one, ending at the scalar filters.
+   What each tier writes over the one below:
+     scalar  every filter; Sub, Average and Paeth specialised for bpp 1, 2, 3, 4, 6, 8
+     sse2    Up for every bpp; Sub, Average and Paeth for bpp 3, 4, 6, 8
+     avx2    Up for every bpp; Sub for bpp 4 and 8
+     avx512  Up for every bpp
+   Average and Paeth depend on the pixel to the left, so they are serial along
+   the row and gain nothing from wider vectors; avx2 and avx512 are therefore
+   SSE2 with wider Up (and Sub) kernels, not full tiers of their own.
+   PNG_DECODER_ISA=scalar|sse2|avx2|avx512 or png_set_isa_level force a lower
+   level, e.g. to benchmark each tier on the same machine. */
+unfilter_fn_t filter_kernels[9][FILTER_KERNEL_COUNT];
+const char *isa_level_names[] = {"scalar", "sse2", "avx2", "avx512"};
+// Shown next to the name: what the level actually runs vectorised
+const char *isa_level_coverage[] = {"no SIMD", "SSE2 Up; Sub, Average and Paeth for bpp 3/4/6/8",
+                                    "as sse2, with AVX2 Up and Sub for bpp 4/8", "as avx2, with AVX-512 Up"};
+PNG_isa_level_t detected_isa_level = PNG_ISA_SCALAR;
+PNG_isa_level_t active_isa_level = PNG_ISA_SCALAR;
+static png_once_t filter_dispatch_once = PNG_ONCE_INIT;
+
+PNG_isa_level_t detect_isa_level(void)
+{
+#if PNG_SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        return PNG_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return PNG_ISA_AVX2;
+    }
+#endif
+#if PNG_SIMD_X86
+    return PNG_ISA_SSE2;
+#else
+    return PNG_ISA_SCALAR;
+#endif
+}
+void fill_filter_table(PNG_isa_level_t level)
+{
+    for (size_t bpp = 1; bpp <= 8; bpp++)
+    {
+        filter_kernels[bpp][FILTER_KERNEL_NONE] = no_filter;
+        filter_kernels[bpp][FILTER_KERNEL_SUB] = sub_filter;
+        filter_kernels[bpp][FILTER_KERNEL_UP] = up_filter;
+        filter_kernels[bpp][FILTER_KERNEL_AVERAGE] = average_filter;
+        filter_kernels[bpp][FILTER_KERNEL_PAETH] = paeth_filter;
+        filter_kernels[bpp][FILTER_KERNEL_AVERAGE_FIRST_ROW] = average_filter_first_row;
+    }
+#define USE_SCALAR_FILTER_KERNELS(BPP)                                                        \
+    filter_kernels[BPP][FILTER_KERNEL_SUB] = sub_filter_bpp##BPP;                             \
+    filter_kernels[BPP][FILTER_KERNEL_AVERAGE] = average_filter_bpp##BPP;                     \
+    filter_kernels[BPP][FILTER_KERNEL_PAETH] = paeth_filter_bpp##BPP;                         \
+    filter_kernels[BPP][FILTER_KERNEL_AVERAGE_FIRST_ROW] = average_filter_first_row_bpp##BPP;
+    USE_SCALAR_FILTER_KERNELS(1)
+    USE_SCALAR_FILTER_KERNELS(2)
+    USE_SCALAR_FILTER_KERNELS(3)
+    USE_SCALAR_FILTER_KERNELS(4)
+    USE_SCALAR_FILTER_KERNELS(6)
+    USE_SCALAR_FILTER_KERNELS(8)
+#undef USE_SCALAR_FILTER_KERNELS
+
+#if PNG_SIMD_X86
+    if (level >= PNG_ISA_SSE2)
+    {
+        for (size_t bpp = 1; bpp <= 8; bpp++)
+        {
+            filter_kernels[bpp][FILTER_KERNEL_UP] = up_filter_sse2;
+        }
+        filter_kernels[3][FILTER_KERNEL_SUB] = sub_filter_sse2_bpp3;
+        filter_kernels[4][FILTER_KERNEL_SUB] = sub_filter_sse2_bpp4;
+        filter_kernels[6][FILTER_KERNEL_SUB] = sub_filter_sse2_bpp6;
+        filter_kernels[8][FILTER_KERNEL_SUB] = sub_filter_sse2_bpp8;
+        filter_kernels[3][FILTER_KERNEL_AVERAGE] = average_filter_sse2_bpp3;
+        filter_kernels[4][FILTER_KERNEL_AVERAGE] = average_filter_sse2_bpp4;
+        filter_kernels[6][FILTER_KERNEL_AVERAGE] = average_filter_sse2_bpp6;
+        filter_kernels[8][FILTER_KERNEL_AVERAGE] = average_filter_sse2_bpp8;
+        filter_kernels[3][FILTER_KERNEL_PAETH] = paeth_filter_sse2_bpp3;
+        filter_kernels[4][FILTER_KERNEL_PAETH] = paeth_filter_sse2_bpp4;
+        filter_kernels[6][FILTER_KERNEL_PAETH] = paeth_filter_sse2_bpp6;
+        filter_kernels[8][FILTER_KERNEL_PAETH] = paeth_filter_sse2_bpp8;
+    }
+#if PNG_SIMD_AVX2
+    if (level >= PNG_ISA_AVX2)
+    {
+        for (size_t bpp = 1; bpp <= 8; bpp++)
+        {
+            filter_kernels[bpp][FILTER_KERNEL_UP] = up_filter_avx2;
+        }
+        filter_kernels[4][FILTER_KERNEL_SUB] = sub_filter_avx2_bpp4;
+        filter_kernels[8][FILTER_KERNEL_SUB] = sub_filter_avx2_bpp8;
+    }
+    if (level >= PNG_ISA_AVX512)
+    {
+        for (size_t bpp = 1; bpp <= 8; bpp++)
+        {
+            filter_kernels[bpp][FILTER_KERNEL_UP] = up_filter_avx512;
+        }
+    }
+#endif
+#endif
+    active_isa_level = level;
+}
+int parse_isa_level(const char *name, PNG_isa_level_t *level)
+{
+    for (int i = PNG_ISA_SCALAR; i <= PNG_ISA_AVX512; i++)
+    {
+        if (strcmp(name, isa_level_names[i]) == 0)
+        {
+            *level = (PNG_isa_level_t)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown ISA level: %s (expected scalar, sse2, avx2 or avx512)\n", name);
+    return -1;
+}
+// Runs once, through png_call_once: the table is complete before any caller returns from init_filter_dispatch
+static void setup_filter_dispatch(void)
+{
+    detected_isa_level = detect_isa_level();
+    PNG_isa_level_t level = detected_isa_level;
+
+    const char *forced = getenv("PNG_DECODER_ISA");
+    PNG_isa_level_t forced_level;
+    if (forced && parse_isa_level(forced, &forced_level) == 0 && check_isa_level(forced_level) == 0)
+    {
+        level = forced_level;
+    }
+    fill_filter_table(level);
+}
+// Safe to call from any thread, any number of times
+void init_filter_dispatch(void)
+{
+    png_call_once(&filter_dispatch_once, setup_filter_dispatch);
+}
+int check_isa_level(PNG_isa_level_t level)
+{
+    if (level > detected_isa_level)
+    {
+        fprintf(stderr, "ISA level %s is not supported by this CPU (best: %s)\n",
+                isa_level_names[level], isa_level_names[detected_isa_level]);
+        return -1;
+    }
+    return 0;
+}
+// Not thread safe: call before starting to decode
+int png_set_isa_level(PNG_isa_level_t level)
+{
+    init_filter_dispatch();
+    if (check_isa_level(level) != 0)
+    {
+        return -1;
+    }
+    fill_filter_table(level);
+    return 0;
+}
+PNG_isa_level_t png_get_isa_level(void)
+{
+    init_filter_dispatch();
+    return active_isa_level;
+}
+#pragma endregion
+#pragma region Streaming
+/* decompress_IDAT + apply_filters keep the whole filtered stream and the whole
+   image in memory at the same time, and by the time apply_filters walks the
+   stream the inflated bytes have long left the cache.
+   Here inflate writes exactly one scanline (filter byte + pixels) into a small
+   buffer, which is unfiltered right away against the previous output row, so
+   both rows are still hot in L1/L2 and only the output image is ever allocated.
+   Everything comes out of decoder->arena, so a failed decode leaves nothing to free. */
+int decode_streaming(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size)
+{
+    if (decoder->interlace_method == 1)
+    {
+        return decode_interlaced(decoder, out_image, out_size); // rows of one pass are not rows of the image
+    }
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    // Whole-buffer backends cannot stop after a row: inflate everything, then unfilter in place
+    if (png_get_inflate_backend()->whole_buffer)
+    {
+        unsigned char *data = NULL;
+        size_t data_size = 0;
+        if (decompress_IDAT(decoder, &data, &data_size) != 0 || data_size != scanline_size * decoder->height)
+        {
+            if (data)
+            {
+                fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", data_size, scanline_size * decoder->height);
+            }
+            return -1;
+        }
+        unsigned char *image = apply_filters_in_place(decoder, data, 1);
+        if (!image)
+        {
+            return -1;
+        }
+        *out_image = image;
+        *out_size = row_size * decoder->height;
+        return 0;
+    }
+
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * decoder->height);
+    unsigned char *scanline = (unsigned char *)png_arena_alloc(&decoder->arena, scanline_size);
+    if (!output || !scanline)
+    {
+        fprintf(stderr, "Failed to allocate memory for streaming decode.\n");
+        return -1;
+    }
+
+    inflater_t inflater;
+    if (inflater_init(&inflater, png_get_inflate_backend(), 0, &decoder->arena) != 0)
+    {
+        return -1;
+    }
+    int ret = inflate_and_unfilter(decoder, &inflater, output, scanline);
+    inflater_end(&inflater);
+    if (ret != 0)
+    {
+        return -1;
+    }
+
+    *out_image = output;
+    *out_size = row_size * decoder->height;
+    return 0;
+}
+// The row loop of decode_streaming: output holds the image, scanline one filtered row
+int inflate_and_unfilter(PNG_decoder_t *decoder, inflater_t *inflater, unsigned char *output, unsigned char *scanline)
+{
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    const unfilter_fn_t *kernels = select_filter_kernels(bytes_per_pixel);
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+    size_t span_index = 0;
+
+    unsigned char *prev_scanline = NULL;
+    unsigned char *current_output = output;
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+
+    for (size_t y = 0; y < decoder->height; y++)
+    {
+        if (inflate_scanline(decoder, inflater, &span_index, scanline, scanline_size) != 0)
+        {
+            fprintf(stderr, "IDAT data ends at scanline %zu of %u\n", y, decoder->height);
+            return -1;
+        }
+
+        // Unfilter it while it is still in cache
+        unsigned char filter_type = scanline[0];
+        if (unfilter_scanline(kernels, filter_type, current_output, scanline + 1, prev_scanline, bytes_per_pixel, row_size) != 0)
+        {
+            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, y);
+            return -1;
+        }
+        decoder->filter_counts[filter_type]++;
+
+        prev_scanline = current_output;
+        current_output += row_size;
+    }
+
+    return finish_IDAT_stream(decoder, inflater, &span_index);
+}
+// Inflates exactly one scanline; -1 if the stream is corrupt or ends before the scanline is full
+int inflate_scanline(PNG_decoder_t *decoder, inflater_t *inflater, size_t *span_index, unsigned char *scanline, size_t scanline_size)
+{
+    inflater->io.next_out = scanline;
+    inflater->io.avail_out = scanline_size;
+    while (inflater->io.avail_out > 0 && inflater->status == INFLATE_MORE)
+    {
+        next_IDAT_input(decoder, &inflater->io, span_index);
+        inflater->status = inflater->backend->feed(inflater->state, &inflater->io);
+        if (inflater->status == INFLATE_ERROR)
+        {
+            return -1;
+        }
+    }
+    return inflater->io.avail_out > 0 ? -1 : 0;
+}
+// All rows are in, only the end of the stream and the adler32 should be left
+int finish_IDAT_stream(PNG_decoder_t *decoder, inflater_t *inflater, size_t *span_index)
+{
+    unsigned char extra;
+    while (inflater->status == INFLATE_MORE)
+    {
+        inflater->io.next_out = &extra;
+        inflater->io.avail_out = 1;
+        next_IDAT_input(decoder, &inflater->io, span_index);
+        inflater->status = inflater->backend->feed(inflater->state, &inflater->io);
+        if (inflater->io.avail_out == 0)
+        {
+            fprintf(stderr, "IDAT data continues past the last scanline\n");
+            return -1;
+        }
+    }
+    if (inflater->status != INFLATE_END)
+    {
+        fprintf(stderr, "Failed to decompress IDAT data.\n");
+        return -1;
+    }
+    return 0;
+}
+#pragma endregion
+#pragma region Row range
+/* Decodes rows [first_row, first_row + row_count) only. Rows above the range
+   still have to be reconstructed, since each row is predicted from the one above,
+   but they go through a two-row rolling buffer instead of the output image, and
+   inflate stops as soon as the last requested row is out: a crop of the top of a
+   long image costs about as much as a decode of the crop alone.
+   Stopping early leaves the rest of the stream, and the adler32, unread; a range
+   that ends at the last row is checked like a full decode.
+   Whole-buffer backends cannot stop after a row, so they inflate everything and
+   only skip reconstructing the rows below the range. */
+int decode_row_range(PNG_decoder_t *decoder, size_t first_row, size_t row_count, unsigned char **out_image, size_t *out_size)
+{
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    if (row_count == 0 || first_row >= decoder->height || row_count > decoder->height - first_row)
+    {
+        fprintf(stderr, "Rows %zu-%zu are outside the image (%u rows)\n", first_row, first_row + row_count - 1, decoder->height);
+        return -1;
+    }
+    if (decoder->interlace_method == 1)
+    {
+        // Every pass covers the whole height: decode everything, return the band
+        unsigned char *image = NULL;
+        size_t image_size = 0;
+        if (decode_interlaced(decoder, &image, &image_size) != 0)
+        {
+            return -1;
+        }
+        size_t image_row_size = image_size / decoder->height;
+        *out_image = image + first_row * image_row_size;
+        *out_size = row_count * image_row_size;
+        return 0;
+    }
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * row_count);
+    if (!output)
+    {
+        fprintf(stderr, "Failed to allocate memory for row range decode.\n");
+        return -1;
+    }
+    if (walk_rows(decoder, bytes_per_pixel, first_row + row_count, output, first_row, NULL, NULL) != 0)
+    {
+        return -1;
+    }
+    *out_image = output;
+    *out_size = row_size * row_count;
+    return 0;
+}
+/* The row loop shared by every mode that consumes rows as they are reconstructed:
+   rows [0, end_row) of a non-interlaced image are unfiltered in order, rows from
+   first_output_row on into output, one after the other, and the rest (all of
+   them when output is NULL) into a two-row rolling buffer. sink, when set, sees
+   each row while it is still in cache. Only a walk that reaches the last row
+   reads the stream to its end. Resets and fills decoder->filter_counts. */
+int walk_rows(PNG_decoder_t *decoder, size_t bytes_per_pixel, size_t end_row, unsigned char *output, size_t first_output_row, row_sink_fn_t sink, void *context)
+{
+    const unfilter_fn_t *kernels = select_filter_kernels(bytes_per_pixel);
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    if (!output)
+    {
+        first_output_row = end_row;
+    }
+    unsigned char *rolling = first_output_row ? (unsigned char *)png_arena_alloc(&decoder->arena, 2 * row_size) : NULL;
+    if (first_output_row && !rolling)
+    {
+        fprintf(stderr, "Failed to allocate memory for rolling rows.\n");
+        return -1;
+    }
+
+    scanline_source_t source;
+    if (scanline_source_open(decoder, &source, row_size + 1) != 0)
+    {
+        return -1;
+    }
+    int ret = -1;
+    unsigned char *prev_scanline = NULL;
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+
+    for (size_t y = 0; y < end_row; y++)
+    {
+        unsigned char *filtered = scanline_source_next(decoder, &source, y);
+        if (!filtered)
+        {
+            goto done;
+        }
+
+        // Rows not kept alternate between the two rolling rows
+        unsigned char *row = y >= first_output_row ? output + (y - first_output_row) * row_size : rolling + (y & 1) * row_size;
+        unsigned char filter_type = filtered[0];
+        if (unfilter_scanline(kernels, filter_type, row, filtered + 1, prev_scanline, bytes_per_pixel, row_size) != 0)
+        {
+            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, y);
+            goto done;
+        }
+        decoder->filter_counts[filter_type]++;
+        prev_scanline = row;
+
+        if (sink)
+        {
+            sink(context, row, y);
+        }
+    }
+
+    if (end_row == decoder->height && scanline_source_finish(decoder, &source) != 0)
+    {
+        goto done;
+    }
+    ret = 0;
+
+done:
+    scanline_source_close(&source);
+    return ret;
+}
+// Whole-buffer backends inflate everything up front, the others one scanline per call
+int scanline_source_open(PNG_decoder_t *decoder, scanline_source_t *source, size_t scanline_size)
+{
+    memset(source, 0, sizeof(*source));
+    source->scanline_size = scanline_size;
+    if (png_get_inflate_backend()->whole_buffer)
+    {
+        size_t data_size = 0;
+        if (decompress_IDAT(decoder, &source->inflated, &data_size) != 0 || data_size != scanline_size * decoder->height)
+        {
+            if (source->inflated)
+            {
+                fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", data_size, scanline_size * decoder->height);
+            }
+            source->inflated = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    source->scanline = (unsigned char *)png_arena_alloc(&decoder->arena, scanline_size);
+    if (!source->scanline)
+    {
+        fprintf(stderr, "Failed to allocate memory for scanline.\n");
+        return -1;
+    }
+    if (inflater_init(&source->inflater, png_get_inflate_backend(), 0, &decoder->arena) != 0)
+    {
+        source->scanline = NULL;
+        return -1;
+    }
+    return 0;
+}
+// Filtered scanline y (filter byte first), valid until the next call; rows come in order
+unsigned char *scanline_source_next(PNG_decoder_t *decoder, scanline_source_t *source, size_t y)
+{
+    if (source->inflated)
+    {
+        return source->inflated + y * source->scanline_size;
+    }
+    if (inflate_scanline(decoder, &source->inflater, &source->span_index, source->scanline, source->scanline_size) != 0)
+    {
+        fprintf(stderr, "IDAT data ends at scanline %zu of %u\n", y, decoder->height);
+        return NULL;
+    }
+    return source->scanline;
+}
+// After the last row: the stream must end there
+int scanline_source_finish(PNG_decoder_t *decoder, scanline_source_t *source)
+{
+    return source->scanline ? finish_IDAT_stream(decoder, &source->inflater, &source->span_index) : 0;
+}
+void scanline_source_close(scanline_source_t *source)
+{
+    if (source->scanline)
+    {
+        inflater_end(&source->inflater);
+        source->scanline = NULL;
+    }
+}
+#pragma endregion
+#pragma region Thumbnail
+/* Box-filtered 1/2, 1/4 or 1/8 scale decode. Each reconstructed row is added
+   into one row of per-column sums as soon as it is unfiltered, and every
+   1 << scale_shift rows the sums are folded into a thumbnail row. Only two scanlines,
+   the sums and the thumbnail are ever allocated: the full-size image is never
+   written, let alone read back for downsampling.
+   Edge blocks of images whose size is not a multiple of the scale average the
+   pixels they have. Palette images are rejected, since averaging indices means
+   nothing. Gray rows of 1, 2 or 4 bits are unpacked and scaled to 0-255 before
+   they are added, so a bilevel scan gives an 8-bit gray thumbnail. */
+int decode_thumbnail(PNG_decoder_t *decoder, unsigned int scale_shift, unsigned char **out_image, size_t *out_size, unsigned int *out_width, unsigned int *out_height)
+{
+    if (scale_shift < 1 || scale_shift > 3)
+    {
+        fprintf(stderr, "Unsupported thumbnail scale: 1/%u\n", 1u << scale_shift);
+        return -1;
+    }
+    if (decoder->color_type == 3 || decoder->interlace_method == 1)
+    {
+        fprintf(stderr, "Thumbnails need non-interlaced gray or truecolor images.\n");
+        return -1;
+    }
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    size_t sample_size = decoder->bit_depth == 16 ? 2 : 1;
+    size_t channels = bytes_per_pixel / sample_size;
+    unsigned int scale = 1u << scale_shift;
+    unsigned int thumb_width = (decoder->width + scale - 1) >> scale_shift;
+    unsigned int thumb_height = (decoder->height + scale - 1) >> scale_shift;
+    size_t thumb_row_size = (size_t)thumb_width * bytes_per_pixel;
+
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, thumb_row_size * thumb_height);
+    // One sum per sample of a row, over at most 8 rows
+    size_t samples = (size_t)decoder->width * channels;
+    uint32_t *column_sums = (uint32_t *)png_arena_alloc(&decoder->arena, samples * sizeof(uint32_t));
+    int packed = decoder->bit_depth < 8;
+    if (packed && !is_packed_bit_depth(decoder->bit_depth))
+    {
+        fprintf(stderr, "Unsupported bit depth: %u\n", decoder->bit_depth);
+        return -1;
+    }
+    sample_unpacker_t unpacker;
+    if (packed)
+    {
+        init_sample_unpacker(&unpacker, decoder->bit_depth, 1);
+    }
+    unsigned char *unpacked = packed ? (unsigned char *)png_arena_alloc(&decoder->arena, samples) : NULL;
+    if (!output || !column_sums || (packed && !unpacked))
+    {
+        fprintf(stderr, "Failed to allocate memory for thumbnail decode.\n");
+        return -1;
+    }
+    memset(column_sums, 0, samples * sizeof(uint32_t));
+
+    thumbnail_sink_t sink = {column_sums, samples, sample_size, channels, decoder->width, decoder->height, scale_shift,
+                             output, thumb_row_size, packed ? &unpacker : NULL, unpacked};
+    if (walk_rows(decoder, bytes_per_pixel, decoder->height, NULL, 0, add_thumbnail_row, &sink) != 0)
+    {
+        return -1;
+    }
+    *out_image = output;
+    *out_size = thumb_row_size * thumb_height;
+    *out_width = thumb_width;
+    *out_height = thumb_height;
+    return 0;
+}
+// Row sink of decode_thumbnail: adds the row to the sums, and every
+// 1 << scale_shift rows (or at the last one) folds them into a thumbnail row
+void add_thumbnail_row(void *context, const unsigned char *row, size_t y)
+{
+    thumbnail_sink_t *sink = (thumbnail_sink_t *)context;
+    if (sink->unpacker)
+    {
+        unpack_samples(sink->unpacker, row, sink->unpacked, sink->width);
+        row = sink->unpacked;
+    }
+    accumulate_thumbnail_row(sink->column_sums, row, sink->samples, sink->sample_size);
+    size_t scale = (size_t)1 << sink->scale_shift;
+    if (((y + 1) & (scale - 1)) == 0 || y + 1 == sink->height)
+    {
+        unsigned int block_rows = (unsigned int)(y & (scale - 1)) + 1;
+        write_thumbnail_row(sink->thumb_row, sink->column_sums, sink->width, block_rows, sink->channels, sink->sample_size, sink->scale_shift);
+        sink->thumb_row += sink->thumb_row_size;
+    }
+}
+// column_sums[i] += row[i] per sample: the vertical half of the box, the only
+// part that runs on every row; 16-bit samples are big-endian
+void accumulate_thumbnail_row(uint32_t *column_sums, const unsigned char *row, size_t samples, size_t sample_size)
+{
+    size_t i = 0;
+    if (sample_size == 2)
+    {
+        for (; i < samples; i++)
+        {
+            column_sums[i] += ((uint32_t)row[2 * i] << 8) | row[2 * i + 1];
+        }
+        return;
+    }
+#if PNG_SIMD_X86
+    // -O2 does not vectorize the widening add: 16 bytes to four vectors of sums by hand
+    if (png_get_isa_level() != PNG_ISA_SCALAR)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= samples; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            __m128i *sums = (__m128i *)(column_sums + i);
+            _mm_storeu_si128(sums, _mm_add_epi32(_mm_loadu_si128(sums), _mm_unpacklo_epi16(low, zero)));
+            _mm_storeu_si128(sums + 1, _mm_add_epi32(_mm_loadu_si128(sums + 1), _mm_unpackhi_epi16(low, zero)));
+            _mm_storeu_si128(sums + 2, _mm_add_epi32(_mm_loadu_si128(sums + 2), _mm_unpacklo_epi16(high, zero)));
+            _mm_storeu_si128(sums + 3, _mm_add_epi32(_mm_loadu_si128(sums + 3), _mm_unpackhi_epi16(high, zero)));
+        }
+    }
+#endif
+    for (; i < samples; i++)
+    {
+        column_sums[i] += row[i];
+    }
+}
+// One thumbnail pixel from block_columns columns of sums; returns the next output pixel
+static PNG_ALWAYS_INLINE unsigned char *write_thumbnail_pixel(unsigned char *output, const uint32_t *column, size_t block_columns, uint32_t count, uint64_t reciprocal, size_t channels, size_t sample_size)
+{
+    for (size_t c = 0; c < channels; c++)
+    {
+        uint32_t sum = 0;
+        for (size_t k = 0; k < block_columns; k++)
+        {
+            sum += column[k * channels + c];
+        }
+        uint32_t average = (uint32_t)(((sum + count / 2) * reciprocal) >> 32);
+        if (sample_size == 1)
+        {
+            *output++ = (unsigned char)average;
+        }
+        else
+        {
+            *output++ = (unsigned char)(average >> 8);
+            *output++ = (unsigned char)average;
+        }
+    }
+    return output;
+}
+// The horizontal half, once per block row; a constant channels lets the
+// compiler unroll the channel loop
+static PNG_ALWAYS_INLINE void write_thumbnail_body(unsigned char *output, const uint32_t *column_sums, size_t width, unsigned int block_rows, size_t channels, size_t sample_size, unsigned int scale_shift)
+{
+    size_t scale = (size_t)1 << scale_shift;
+    size_t full_blocks = width >> scale_shift;
+    // sum / count as a multiply, exact for sums below 2^26 (64 16-bit samples at most)
+    uint32_t count = (uint32_t)(scale * block_rows);
+    uint64_t reciprocal = ((uint64_t)1 << 32) / count + 1;
+    for (size_t x = 0; x < full_blocks; x++)
+    {
+        output = write_thumbnail_pixel(output, column_sums + (x << scale_shift) * channels, scale, count, reciprocal, channels, sample_size);
+    }
+    // Partial block at the right edge
+    size_t edge_columns = width - (full_blocks << scale_shift);
+    if (edge_columns)
+    {
+        count = (uint32_t)(edge_columns * block_rows);
+        reciprocal = ((uint64_t)1 << 32) / count + 1;
+        write_thumbnail_pixel(output, column_sums + (full_blocks << scale_shift) * channels, edge_columns, count, reciprocal, channels, sample_size);
+    }
+}
+// Rounded block averages of column_sums into output, then clears them for the next block row
+void write_thumbnail_row(unsigned char *output, uint32_t *column_sums, size_t width, unsigned int block_rows, size_t channels, size_t sample_size, unsigned int scale_shift)
+{
+    switch (channels)
+    {
+    case 1:
+        write_thumbnail_body(output, column_sums, width, block_rows, 1, sample_size, scale_shift);
+        break;
+    case 2:
+        write_thumbnail_body(output, column_sums, width, block_rows, 2, sample_size, scale_shift);
+        break;
+    case 3:
+        write_thumbnail_body(output, column_sums, width, block_rows, 3, sample_size, scale_shift);
+        break;
+    default:
+        write_thumbnail_body(output, column_sums, width, block_rows, 4, sample_size, scale_shift);
+        break;
+    }
+    memset(column_sums, 0, width * channels * sizeof(uint32_t));
+}
+#pragma endregion
+#pragma region Unpack
+/* Gray and palette images of bit depth 1, 2 or 4 pack 8, 4 or 2 samples into
+   each byte, leftmost pixel in the high bits. Everything else here unfilters
+   and returns them packed, as stored. decode_unpacked widens each row to one
+   byte per sample as soon as it is unfiltered; with scale set, gray levels are
+   also stretched to 0-255 (times 255, 85 or 17), otherwise the raw values are
+   kept, which is what palette indices need.
+   A 256-entry table maps a packed byte to its samples, so a row costs one load
+   and one 8-byte store per packed byte, whatever the bit depth: at 2 and 4 bits
+   the store runs past the byte's samples and the next one overwrites the rest. */
+int decode_unpacked(PNG_decoder_t *decoder, int scale, unsigned char **out_image, size_t *out_size)
+{
+    if ((decoder->color_type != 0 && decoder->color_type != 3) || !is_packed_bit_depth(decoder->bit_depth))
+    {
+        fprintf(stderr, "Unpacking needs a gray or palette image with 1, 2 or 4-bit samples.\n");
+        return -1;
+    }
+    sample_unpacker_t unpacker;
+    init_sample_unpacker(&unpacker, decoder->bit_depth, scale && decoder->color_type == 0);
+    size_t row_size = get_row_size(decoder, 1);
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, (size_t)decoder->width * decoder->height);
+    if (!output)
+    {
+        fprintf(stderr, "Failed to allocate memory for unpacked image.\n");
+        return -1;
+    }
+
+    unpack_sink_t sink = {&unpacker, output, decoder->width};
+
+    // Adam7 rows only exist once the passes are deinterlaced: unpack afterwards
+    if (decoder->interlace_method == 1)
+    {
+        unsigned char *packed = NULL;
+        size_t packed_size = 0;
+        if (decode_interlaced(decoder, &packed, &packed_size) != 0)
+        {
+            return -1;
+        }
+        for (size_t y = 0; y < decoder->height; y++)
+        {
+            unpack_output_row(&sink, packed + y * row_size, y);
+        }
+    }
+    else if (walk_rows(decoder, 1, decoder->height, NULL, 0, unpack_output_row, &sink) != 0)
+    {
+        return -1;
+    }
+    *out_image = output;
+    *out_size = (size_t)decoder->width * decoder->height;
+    return 0;
+}
+// Row sink of decode_unpacked: packed row y into its place in the output
+void unpack_output_row(void *context, const unsigned char *row, size_t y)
+{
+    unpack_sink_t *sink = (unpack_sink_t *)context;
+    unpack_samples(sink->unpacker, row, sink->output + y * sink->width, sink->width);
+}
+// The sub-byte depths the spec allows, the only ones init_sample_unpacker and unpack_samples take
+int is_packed_bit_depth(unsigned int bit_depth)
+{
+    return bit_depth == 1 || bit_depth == 2 || bit_depth == 4;
+}
+// Table for one bit depth (1, 2 or 4); scale stretches the samples to 0-255
+void init_sample_unpacker(sample_unpacker_t *unpacker, unsigned int bit_depth, int scale)
+{
+    unsigned int mask = (1u << bit_depth) - 1;
+    unsigned int factor = scale ? 255 / mask : 1;
+    unpacker->bit_depth = bit_depth;
+    memset(unpacker->lut, 0, sizeof(unpacker->lut));
+    for (unsigned int value = 0; value < 256; value++)
+    {
+        for (unsigned int k = 0; k < 8 / bit_depth; k++)
+        {
+            unpacker->lut[value][k] = (unsigned char)(((value >> (8 - bit_depth * (k + 1))) & mask) * factor);
+        }
+    }
+}
+// A constant samples_per_byte turns the tail arithmetic into shifts
+static PNG_ALWAYS_INLINE void unpack_samples_body(const unsigned char (*lut)[8], const unsigned char *packed, unsigned char *output, size_t width, size_t samples_per_byte)
+{
+    // Whole 8-byte stores while they stay inside the row, then exact copies
+    size_t bulk = width >= 8 ? (width - 8) / samples_per_byte + 1 : 0;
+    size_t i = 0;
+    for (; i < bulk; i++)
+    {
+        memcpy(output + i * samples_per_byte, lut[packed[i]], 8);
+    }
+    for (size_t x = i * samples_per_byte; x < width; i++, x += samples_per_byte)
+    {
+        memcpy(output + x, lut[packed[i]], width - x < samples_per_byte ? width - x : samples_per_byte);
+    }
+}
+// width samples of a packed row to one byte each
+void unpack_samples(const sample_unpacker_t *unpacker, const unsigned char *packed, unsigned char *output, size_t width)
+{
+    switch (unpacker->bit_depth)
+    {
+    case 1:
+        unpack_samples_body(unpacker->lut, packed, output, width, 8);
+        break;
+    case 2:
+        unpack_samples_body(unpacker->lut, packed, output, width, 4);
+        break;
+    case 4:
+        unpack_samples_body(unpacker->lut, packed, output, width, 2);
+        break;
+    }
+}
+#pragma endregion
+#pragma region Palette
+/* Color type 3 rows hold palette indices. decode_palette_expanded turns them
+   into RGB, or RGBA when a tRNS chunk is present, one row at a time: each row
+   is unfiltered into a two-row index buffer and expanded into the output while
+   it is still in L1, so the index image is never materialized and no separate
+   expansion pass walks the output again.
+   parse_PLTE and parse_tRNS already built the 256-entry RGBA table, so
+   expanding a pixel is one 4-byte load. With AVX2, palettes of up to 16
+   entries are split into R, G, B and A planes and looked up 16 pixels per
+   pshufb; larger palettes use a gather, 8 pixels per instruction.
+   Indices of 1, 2 or 4 bits are unpacked to one byte each first (see Unpack). */
+int decode_palette_expanded(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size)
+{
+    if (decoder->color_type != 3 || !decoder->palette || !valid_bit_depth(3, decoder->bit_depth))
+    {
+        fprintf(stderr, "Palette expansion needs a palette image with a PLTE chunk.\n");
+        return -1;
+    }
+    int alpha = decoder->palette_alpha;
+    size_t output_row_size = (size_t)decoder->width * (alpha ? 4 : 3);
+    size_t row_size = get_row_size(decoder, 1);
+    int packed = decoder->bit_depth < 8;
+    if (packed && !is_packed_bit_depth(decoder->bit_depth))
+    {
+        fprintf(stderr, "Unsupported bit depth: %u\n", decoder->bit_depth);
+        return -1;
+    }
+    sample_unpacker_t unpacker;
+    if (packed)
+    {
+        init_sample_unpacker(&unpacker, decoder->bit_depth, 0);
+    }
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, output_row_size * decoder->height);
+    // Packed rows are unpacked into this one before the lookup
+    unsigned char *unpacked = packed ? (unsigned char *)png_arena_alloc(&decoder->arena, decoder->width) : NULL;
+    if (!output || (packed && !unpacked))
+    {
+        fprintf(stderr, "Failed to allocate memory for palette expansion.\n");
+        return -1;
+    }
+
+    palette_sink_t sink = {decoder, output, output_row_size, packed ? &unpacker : NULL, unpacked};
+
+    // Adam7 rows only exist once the passes are deinterlaced: expand afterwards
+    if (decoder->interlace_method == 1)
+    {
+        unsigned char *indices = NULL;
+        size_t indices_size = 0;
+        if (decode_interlaced(decoder, &indices, &indices_size) != 0)
+        {
+            return -1;
+        }
+        for (size_t y = 0; y < decoder->height; y++)
+        {
+            expand_indexed_row(&sink, indices + y * row_size, y);
+        }
+    }
+    else if (walk_rows(decoder, 1, decoder->height, NULL, 0, expand_indexed_row, &sink) != 0)
+    {
+        return -1;
+    }
+    *out_image = output;
+    *out_size = output_row_size * decoder->height;
+    return 0;
+}
+// Row sink of decode_palette_expanded: row y of indices, packed or not, into the output
+void expand_indexed_row(void *context, const unsigned char *row, size_t y)
+{
+    palette_sink_t *sink = (palette_sink_t *)context;
+    if (sink->unpacker)
+    {
+        unpack_samples(sink->unpacker, row, sink->unpacked, sink->decoder->width);
+        row = sink->unpacked;
+    }
+    expand_palette_row(sink->decoder, row, sink->output + y * sink->output_row_size);
+}
+// One row of indices to RGB or RGBA, with the best kernel the CPU and --isa allow
+void expand_palette_row(PNG_decoder_t *decoder, const unsigned char *indices, unsigned char *output)
+{
+#if PNG_SIMD_AVX2
+    if (png_get_isa_level() >= PNG_ISA_AVX2)
+    {
+        expand_palette_avx2(decoder->palette, decoder->palette_size, indices, output, decoder->width, decoder->palette_alpha);
+        return;
+    }
+#endif
+    expand_palette_scalar(decoder->palette, indices, output, decoder->width, decoder->palette_alpha);
+}
+void expand_palette_scalar(const uint32_t *palette, const unsigned char *indices, unsigned char *output, size_t width, int alpha)
+{
+    if (alpha)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            memcpy(output + 4 * x, &palette[indices[x]], 4);
+        }
+        return;
+    }
+    for (size_t x = 0; x < width; x++)
+    {
+        memcpy(output + 3 * x, &palette[indices[x]], 3);
+    }
+}
+#if PNG_SIMD_AVX2
+PNG_TARGET_AVX2 void expand_palette_avx2(const uint32_t *palette, unsigned int palette_size, const unsigned char *indices, unsigned char *output, size_t width, int alpha)
+{
+    size_t channels = alpha ? 4 : 3;
+    // RGB output keeps the first 12 bytes of every 16 RGBA ones, then stores all 16:
+    // the 4 extra bytes are overwritten by the next store, so two pixels of room must follow
+    size_t room = alpha ? 0 : 2;
+    const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t x = 0;
+
+    if (palette_size <= 16)
+    {
+        // 4x4 transposes turn the 16 RGBA entries into one 16-byte table per channel
+        const __m128i planar = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        __m128i e0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)palette), planar);
+        __m128i e1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 4)), planar);
+        __m128i e2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 8)), planar);
+        __m128i e3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(palette + 12)), planar);
+        __m128i t0 = _mm_unpacklo_epi32(e0, e1);
+        __m128i t1 = _mm_unpacklo_epi32(e2, e3);
+        __m128i t2 = _mm_unpackhi_epi32(e0, e1);
+        __m128i t3 = _mm_unpackhi_epi32(e2, e3);
+        // Each lane of a 256-bit shuffle looks up 16 indices in its own copy of the table
+        const __m256i red = _mm256_broadcastsi128_si256(_mm_unpacklo_epi64(t0, t1));
+        const __m256i green = _mm256_broadcastsi128_si256(_mm_unpackhi_epi64(t0, t1));
+        const __m256i blue = _mm256_broadcastsi128_si256(_mm_unpacklo_epi64(t2, t3));
+        const __m256i opacity = _mm256_broadcastsi128_si256(_mm_unpackhi_epi64(t2, t3));
+        const __m256i drop_alpha_256 = _mm256_broadcastsi128_si256(drop_alpha);
+        const __m256i high_nibble = _mm256_set1_epi8((char)0xF0);
+
+        for (; x + 32 + room <= width; x += 32)
+        {
+            __m256i index = _mm256_loadu_si256((const __m256i *)(indices + x));
+            // pshufb only looks at the low nibble: indices past 15 take the scalar path
+            if (!_mm256_testz_si256(index, high_nibble))
+            {
+                expand_palette_scalar(palette, indices + x, output + x * channels, 32, alpha);
+                continue;
+            }
+            __m256i r = _mm256_shuffle_epi8(red, index);
+            __m256i g = _mm256_shuffle_epi8(green, index);
+            __m256i b = _mm256_shuffle_epi8(blue, index);
+            __m256i a = _mm256_shuffle_epi8(opacity, index);
+            __m256i rg_low = _mm256_unpacklo_epi8(r, g);
+            __m256i rg_high = _mm256_unpackhi_epi8(r, g);
+            __m256i ba_low = _mm256_unpacklo_epi8(b, a);
+            __m256i ba_high = _mm256_unpackhi_epi8(b, a);
+            // Unpacks stay inside a lane: quarter k holds pixels 4k..4k+3 low and 16+4k.. high
+            __m256i q0 = _mm256_unpacklo_epi16(rg_low, ba_low);
+            __m256i q1 = _mm256_unpackhi_epi16(rg_low, ba_low);
+            __m256i q2 = _mm256_unpacklo_epi16(rg_high, ba_high);
+            __m256i q3 = _mm256_unpackhi_epi16(rg_high, ba_high);
+            if (alpha)
+            {
+                unsigned char *row = output + 4 * x;
+                _mm256_storeu_si256((__m256i *)row, _mm256_permute2x128_si256(q0, q1, 0x20));
+                _mm256_storeu_si256((__m256i *)(row + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+                _mm256_storeu_si256((__m256i *)(row + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+                _mm256_storeu_si256((__m256i *)(row + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+            }
+            else
+            {
+                unsigned char *row = output + 3 * x;
+                q0 = _mm256_shuffle_epi8(q0, drop_alpha_256);
+                q1 = _mm256_shuffle_epi8(q1, drop_alpha_256);
+                q2 = _mm256_shuffle_epi8(q2, drop_alpha_256);
+                q3 = _mm256_shuffle_epi8(q3, drop_alpha_256);
+                _mm_storeu_si128((__m128i *)row, _mm256_castsi256_si128(q0));
+                _mm_storeu_si128((__m128i *)(row + 12), _mm256_castsi256_si128(q1));
+                _mm_storeu_si128((__m128i *)(row + 24), _mm256_castsi256_si128(q2));
+                _mm_storeu_si128((__m128i *)(row + 36), _mm256_castsi256_si128(q3));
+                _mm_storeu_si128((__m128i *)(row + 48), _mm256_extracti128_si256(q0, 1));
+                _mm_storeu_si128((__m128i *)(row + 60), _mm256_extracti128_si256(q1, 1));
+                _mm_storeu_si128((__m128i *)(row + 72), _mm256_extracti128_si256(q2, 1));
+                _mm_storeu_si128((__m128i *)(row + 84), _mm256_extracti128_si256(q3, 1));
+            }
+        }
+    }
+    else
+    {
+        const __m256i drop_alpha_256 = _mm256_broadcastsi128_si256(drop_alpha);
+        for (; x + 8 + room <= width; x += 8)
+        {
+            __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indices + x)));
+            __m256i pixels = _mm256_i32gather_epi32((const int *)palette, index, 4);
+            if (alpha)
+            {
+                _mm256_storeu_si256((__m256i *)(output + 4 * x), pixels);
+            }
+            else
+            {
+                pixels = _mm256_shuffle_epi8(pixels, drop_alpha_256);
+                _mm_storeu_si128((__m128i *)(output + 3 * x), _mm256_castsi256_si128(pixels));
+                _mm_storeu_si128((__m128i *)(output + 3 * x + 12), _mm256_extracti128_si256(pixels, 1));
+            }
+        }
+    }
+    expand_palette_scalar(palette, indices + x, output + x * channels, width - x, alpha);
+}
+#endif
+#pragma endregion
+#pragma region Pipeline
+/* decode_streaming runs inflate and unfilter back to back on one thread, so a
+   large image costs inflate + unfilter. Here a second thread inflates rows
+   into a ring of scanline slots while the calling thread unfilters them as
+   they arrive, which brings the time down towards max(inflate, unfilter).
+   The ring has one producer and one consumer, so two counters are enough:
+   slot y % slot_count is free while y - consumed < slot_count and holds a
+   finished scanline while y < produced. The release store of a counter
+   publishes the slot contents, the acquire load on the other side sees them.
+   A waiting side yields instead of blocking: the other thread is normally
+   at most one row away.
+   The arena is not thread-safe: from the start of the inflate thread to its
+   join only that thread allocates from decoder->arena (zlib sets up its
+   window on the first inflate call). */
+void *inflate_rows(void *arg)
+{
+    scanline_ring_t *ring = (scanline_ring_t *)arg;
+    PNG_decoder_t *decoder = ring->decoder;
+
+    inflater_t inflater;
+    if (inflater_init(&inflater, png_get_inflate_backend(), 0, &decoder->arena) != 0)
+    {
+        atomic_store_explicit(&ring->failed, 1, memory_order_release);
+        return NULL;
+    }
+    size_t span_index = 0;
+
+    for (size_t y = 0; y < decoder->height; y++)
+    {
+        // Wait for the unfilter thread to hand back the slot
+        while (y - atomic_load_explicit(&ring->consumed, memory_order_acquire) >= ring->slot_count)
+        {
+            if (atomic_load_explicit(&ring->failed, memory_order_acquire))
+            {
+                inflater_end(&inflater);
+                return NULL;
+            }
+            png_yield();
+        }
+
+        unsigned char *slot = ring->slots + (y % ring->slot_count) * ring->slot_size;
+        if (inflate_scanline(decoder, &inflater, &span_index, slot, ring->scanline_size) != 0)
+        {
+            fprintf(stderr, "IDAT data ends at scanline %zu of %u\n", y, decoder->height);
+            atomic_store_explicit(&ring->failed, 1, memory_order_release);
+            inflater_end(&inflater);
+            return NULL;
+        }
+        atomic_store_explicit(&ring->produced, y + 1, memory_order_release);
+    }
+
+    if (finish_IDAT_stream(decoder, &inflater, &span_index) != 0)
+    {
+        atomic_store_explicit(&ring->failed, 1, memory_order_release);
+    }
+    inflater_end(&inflater);
+    return NULL;
+}
+// Same result as decode_streaming; falls back to it if the inflate thread cannot be started,
+// the backend cannot inflate row by row or the image is interlaced
+int decode_pipelined(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size)
+{
+    if (png_get_inflate_backend()->whole_buffer || decoder->interlace_method == 1)
+    {
+        return decode_streaming(decoder, out_image, out_size);
+    }
+
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    const unfilter_fn_t *kernels = select_filter_kernels(bytes_per_pixel);
+
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    // About 256 KB of slots: enough slack to ride out a slow inflate block,
+    // small enough to stay in L2 together with the rows being written.
+    size_t slot_size = (scanline_size + 63) & ~(size_t)63;
+    size_t slot_count = (256 * 1024) / slot_size;
+    if (slot_count < 4)
+    {
+        slot_count = 4;
+    }
+    if (slot_count > decoder->height)
+    {
+        slot_count = decoder->height ? decoder->height : 1;
+    }
+
+    // The ring stays on this stack frame, which outlives the inflate thread
+    scanline_ring_t ring_storage;
+    scanline_ring_t *ring = &ring_storage;
+    png_arena_mark_t mark = png_arena_mark(&decoder->arena);
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * decoder->height);
+    unsigned char *slots = (unsigned char *)png_arena_alloc(&decoder->arena, slot_size * slot_count);
+    if (!output || !slots)
+    {
+        fprintf(stderr, "Failed to allocate memory for pipelined decode.\n");
+        return -1;
+    }
+    ring->decoder = decoder;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->slot_count = slot_count;
+    ring->scanline_size = scanline_size;
+    atomic_init(&ring->produced, 0);
+    atomic_init(&ring->consumed, 0);
+    atomic_init(&ring->failed, 0);
+
+    png_thread_t inflater;
+    if (png_thread_create(&inflater, inflate_rows, ring) != 0)
+    {
+        png_arena_release(&decoder->arena, mark);
+        return decode_streaming(decoder, out_image, out_size);
+    }
+
+    unsigned char *prev_scanline = NULL;
+    unsigned char *current_output = output;
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+
+    for (size_t y = 0; y < decoder->height; y++)
+    {
+        // Wait for the inflate thread to fill the slot
+        while (atomic_load_explicit(&ring->produced, memory_order_acquire) <= y)
+        {
+            if (atomic_load_explicit(&ring->failed, memory_order_acquire))
+            {
+                goto done;
+            }
+            png_yield();
+        }
+
+        unsigned char *scanline = slots + (y % slot_count) * slot_size;
+        unsigned char filter_type = scanline[0];
+        if (unfilter_scanline(kernels, filter_type, current_output, scanline + 1, prev_scanline, bytes_per_pixel, row_size) != 0)
+        {
+            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, y);
+            atomic_store_explicit(&ring->failed, 1, memory_order_release);
+            goto done;
+        }
+        decoder->filter_counts[filter_type]++;
+        atomic_store_explicit(&ring->consumed, y + 1, memory_order_release);
+
+        prev_scanline = current_output;
+        current_output += row_size;
+    }
+
+done:
+    png_thread_join(inflater); // also waits for the end-of-stream check
+    if (atomic_load_explicit(&ring->failed, memory_order_acquire))
+    {
+        return -1;
+    }
+
+    *out_image = output;
+    *out_size = row_size * decoder->height;
+    return 0;
+}
+#pragma endregion
+#pragma region Split IDAT
+/* Apple's iDOT chunk splits the image into a top and a bottom half whose
+   IDAT data can be inflated separately: the encoder does a full flush at
+   the boundary, so the bottom half starts on a byte boundary with an empty
+   dictionary and inflates as a raw deflate stream. The zlib header sits in
+   front of the top half, and the adler32 trailer after the bottom half
+   covers both.
+   The two halves are inflated and unfiltered on two threads. The bottom
+   half can only be unfiltered on its own if its first row does not look at
+   the row above it (filter None or Sub); otherwise its filtered rows are
+   kept and unfiltered once the top half is done.
+   Anything that does not line up with the IDAT chunks falls back to
+   decode_streaming. */
+void parse_iDOT(PNG_decoder_t *decoder, unsigned char *chunk_data, size_t chunk_size)
+{
+    // height divisor, reserved, divided height, first IDAT offset,
+    // top rows, bottom rows, restart IDAT offset; offsets count from the iDOT length field
+    if (chunk_size != 28 || to_big_endian(chunk_data) != 2 || to_big_endian(chunk_data + 4) != 0)
+    {
+        fprintf(stderr, "Ignoring unsupported iDOT chunk\n");
+        return;
+    }
+    size_t chunk_offset = (size_t)(chunk_data - decoder->data) - 8;
+    decoder->idot_first_idat = chunk_offset + to_big_endian(chunk_data + 12);
+    decoder->idot_rows[0] = to_big_endian(chunk_data + 16);
+    decoder->idot_rows[1] = to_big_endian(chunk_data + 20);
+    decoder->idot_second_idat = chunk_offset + to_big_endian(chunk_data + 24);
+}
+// Splits decoder's IDAT spans at the iDOT restart point; 0 if they match the iDOT chunk
+int split_IDAT_segments(PNG_decoder_t *decoder, IDAT_segment_t segments[2])
+{
+    if (decoder->idot_second_idat == 0 || decoder->interlace_method != 0 || decoder->idat_count < 2 ||
+        decoder->idot_rows[0] == 0 || decoder->idot_rows[1] == 0 ||
+        (uint64_t)decoder->idot_rows[0] + decoder->idot_rows[1] != decoder->height ||
+        decoder->idat_spans[0].offset != decoder->idot_first_idat + 8) // + 8: length and type
+    {
+        return -1;
+    }
+
+    size_t restart = 1;
+    while (restart < decoder->idat_count && decoder->idat_spans[restart].offset != decoder->idot_second_idat + 8)
+    {
+        restart++;
+    }
+    if (restart == decoder->idat_count)
+    {
+        return -1;
+    }
+
+    memset(segments, 0, 2 * sizeof(IDAT_segment_t));
+    for (int i = 0; i < 2; i++)
+    {
+        segments[i].view = *decoder;
+        png_arena_init(&segments[i].view.arena); // each segment's thread allocates from its own arena
+        segments[i].raw = i > 0;
+    }
+    segments[0].view.idat_count = restart;
+    segments[1].view.idat_spans = decoder->idat_spans + restart;
+    segments[1].view.idat_count = decoder->idat_count - restart;
+    segments[0].rows = decoder->idot_rows[0];
+    segments[1].first_row = decoder->idot_rows[0];
+    segments[1].rows = decoder->idot_rows[1];
+    return 0;
+}
+// Inflates and unfilters the rows of one segment into segment->output
+void *decode_IDAT_segment(void *arg)
+{
+    IDAT_segment_t *segment = (IDAT_segment_t *)arg;
+    PNG_decoder_t *view = &segment->view;
+    size_t bytes_per_pixel = get_bytes_per_pixel(view);
+    const unfilter_fn_t *kernels = select_filter_kernels(bytes_per_pixel);
+    size_t row_size = get_row_size(view, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    segment->status = -1;
+    memset(view->filter_counts, 0, sizeof(view->filter_counts));
+
+    // Only the first segment has the zlib header; the others start mid-stream
+    inflater_t inflater;
+    if (inflater_init(&inflater, png_get_inflate_backend(), segment->raw, &view->arena) != 0)
+    {
+        return NULL;
+    }
+    size_t span_index = 0;
+
+    unsigned char *scanline = (unsigned char *)png_arena_alloc(&view->arena, scanline_size);
+    if (!scanline)
+    {
+        fprintf(stderr, "Failed to allocate memory for segment decode.\n");
+        inflater_end(&inflater);
+        return NULL;
+    }
+    unsigned char *prev_scanline = NULL;
+    unsigned char *current_output = segment->output;
+    uLong adler = adler32(0L, Z_NULL, 0);
+
+    for (size_t y = 0; y < segment->rows; y++)
+    {
+        unsigned char *filtered = segment->deferred ? segment->deferred + y * scanline_size : scanline;
+        if (inflate_scanline(view, &inflater, &span_index, filtered, scanline_size) != 0)
+        {
+            fprintf(stderr, "IDAT data ends at scanline %zu of %u\n", segment->first_row + y, view->height);
+            goto done;
+        }
+        adler = adler32(adler, filtered, (uInt)scanline_size);
+
+        // A first row that reads the row above has to wait for the previous segment
+        if (y == 0 && segment->first_row > 0 && filtered[0] > 1)
+        {
+            segment->deferred = (unsigned char *)png_arena_alloc(&view->arena, segment->rows * scanline_size);
+            if (!segment->deferred)
+            {
+                fprintf(stderr, "Failed to allocate memory for segment decode.\n");
+                goto done;
+            }
+            memcpy(segment->deferred, filtered, scanline_size);
+        }
+        if (segment->deferred)
+        {
+            continue;
+        }
+
+        unsigned char filter_type = filtered[0];
+        if (unfilter_scanline(kernels, filter_type, current_output, filtered + 1, prev_scanline, bytes_per_pixel, row_size) != 0)
+        {
+            fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filter_type, segment->first_row + y);
+            goto done;
+        }
+        view->filter_counts[filter_type]++;
+
+        prev_scanline = current_output;
+        current_output += row_size;
+    }
+
+    segment->adler = adler;
+    if (!segment->raw)
+    {
+        segment->status = 0;
+        goto done;
+    }
+
+    // The last segment ends the deflate stream and carries the adler32 of all of them
+    if (finish_IDAT_stream(view, &inflater, &span_index) != 0)
+    {
+        goto done;
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        if (!next_IDAT_input(view, &inflater.io, &span_index))
+        {
+            fprintf(stderr, "IDAT data ends inside the adler32 checksum\n");
+            goto done;
+        }
+        segment->trailer[i] = *inflater.io.next_in++;
+        inflater.io.avail_in--;
+    }
+    segment->status = 0;
+
+done:
+    inflater_end(&inflater);
+    return NULL;
+}
+// Like decode_streaming, but inflates the two halves of an iDOT image in parallel
+int decode_split_IDAT(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size)
+{
+    IDAT_segment_t segments[2];
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (png_get_inflate_backend()->whole_buffer)
+    {
+        return decode_streaming(decoder, out_image, out_size); // segments are inflated row by row
+    }
+    if (bytes_per_pixel == 0 || split_IDAT_segments(decoder, segments) != 0)
+    {
+        if (decoder->idot_second_idat != 0)
+        {
+            fprintf(stderr, "iDOT chunk does not match the IDAT chunks, decoding serially\n");
+        }
+        return decode_streaming(decoder, out_image, out_size);
+    }
+    const unfilter_fn_t *kernels = select_filter_kernels(bytes_per_pixel);
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    png_arena_mark_t mark = png_arena_mark(&decoder->arena);
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * decoder->height);
+    if (!output)
+    {
+        fprintf(stderr, "Failed to allocate memory for split decode.\n");
+        png_arena_free(&segments[0].view.arena);
+        png_arena_free(&segments[1].view.arena);
+        return -1;
+    }
+    segments[0].output = output;
+    segments[1].output = output + segments[1].first_row * row_size;
+
+    // The bottom half on a second thread, the top half on this one
+    png_thread_t thread;
+    int threaded = png_thread_create(&thread, decode_IDAT_segment, &segments[1]) == 0;
+    decode_IDAT_segment(&segments[0]);
+    if (threaded)
+    {
+        png_thread_join(thread);
+    }
+    else
+    {
+        decode_IDAT_segment(&segments[1]);
+    }
+
+    int status = segments[0].status == 0 && segments[1].status == 0 ? 0 : -1;
+    if (status == 0)
+    {
+        size_t bottom_size = segments[1].rows * scanline_size;
+        uLong adler = adler32_combine(segments[0].adler, segments[1].adler, (z_off_t)bottom_size);
+        if (adler != to_big_endian(segments[1].trailer))
+        {
+            fprintf(stderr, "iDOT halves do not form one zlib stream (adler32 mismatch)\n");
+            status = -1;
+        }
+    }
+
+    // Rows of the bottom half that had to wait for the top half's last row
+    if (status == 0 && segments[1].deferred)
+    {
+        unsigned char *prev_scanline = segments[1].output - row_size;
+        unsigned char *current_output = segments[1].output;
+        for (size_t y = 0; y < segments[1].rows; y++)
+        {
+            unsigned char *filtered = segments[1].deferred + y * scanline_size;
+            if (unfilter_scanline(kernels, filtered[0], current_output, filtered + 1, prev_scanline, bytes_per_pixel, row_size) != 0)
+            {
+                fprintf(stderr, "Invalid filter type: %u at scanline %zu\n", filtered[0], segments[1].first_row + y);
+                status = -1;
+                break;
+            }
+            segments[1].view.filter_counts[filtered[0]]++;
+            prev_scanline = current_output;
+            current_output += row_size;
+        }
+    }
+    png_arena_free(&segments[0].view.arena);
+    png_arena_free(&segments[1].view.arena);
+
+    if (status != 0)
+    {
+        png_arena_release(&decoder->arena, mark); // drop the output before decoding again
+        fprintf(stderr, "Split IDAT decode failed, decoding serially\n");
+        return decode_streaming(decoder, out_image, out_size);
+    }
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        decoder->filter_counts[i] = segments[0].view.filter_counts[i] + segments[1].view.filter_counts[i];
+    }
+    *out_image = output;
+    *out_size = row_size * decoder->height;
+    return 0;
+}
+#pragma endregion
+#pragma region Adam7
+/* Adam7 stores seven sub-images one after the other in the inflated stream,
+   each with its own rows, filter bytes and row chain: pass 1 holds every 8th
+   pixel of every 8th row, ..., pass 7 every pixel of every odd row. Their
+   offsets follow from the IHDR alone, so once the stream is inflated every
+   pass is unfiltered on its own, in place like apply_filters_in_place.
+   Passes 1-6 and pass 7 each hold half of the pixels, so large images
+   unfilter passes 1-6 on a second thread while this one does pass 7, then
+   split the deinterlace into a top and a bottom half the same way.
+   The deinterlace builds the final image row by row: odd rows are a pass 7
+   row as is, rows 2 mod 4 interleave a pass 5 and a pass 6 row pixel by
+   pixel (SSE2 unpacks for 1, 2, 4 and 8 bytes per pixel), and only the
+   remaining quarter of the rows scatters pixels one by one. */
+
+// Below this much filtered data a second thread costs more than it saves
+#define PNG_ADAM7_PARALLEL_MIN (256 * 1024)
+
+// x start, y start, x step, y step of each pass
+static const unsigned char adam7_layout[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+
+// Sizes of the seven passes; returns the size of the whole filtered stream
+size_t locate_adam7_passes(PNG_decoder_t *decoder, size_t bytes_per_pixel, adam7_pass_t passes[7])
+{
+    size_t offset = 0;
+    memset(passes, 0, 7 * sizeof(adam7_pass_t));
+    for (int p = 0; p < 7; p++)
+    {
+        size_t x_start = adam7_layout[p][0], y_start = adam7_layout[p][1];
+        size_t x_step = adam7_layout[p][2], y_step = adam7_layout[p][3];
+        passes[p].width = decoder->width > x_start ? (decoder->width - x_start + x_step - 1) / x_step : 0;
+        passes[p].height = decoder->height > y_start ? (decoder->height - y_start + y_step - 1) / y_step : 0;
+        if (passes[p].width == 0 || passes[p].height == 0)
+        {
+            passes[p].width = passes[p].height = 0; // an empty pass has no filter bytes either
+        }
+        passes[p].row_size = get_packed_row_size(passes[p].width, decoder->bit_depth, bytes_per_pixel);
+        passes[p].offset = offset;
+        offset += passes[p].height * (passes[p].row_size + 1); // + 1: filter byte
+    }
+    return offset;
+}
+int decode_interlaced(PNG_decoder_t *decoder, unsigned char **out_image, size_t *out_size)
+{
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    adam7_pass_t passes[7];
+    size_t stream_size = locate_adam7_passes(decoder, bytes_per_pixel, passes);
+
+    unsigned char *data = NULL;
+    size_t data_size = 0;
+    if (decompress_IDAT(decoder, &data, &data_size) != 0 || data_size != stream_size)
+    {
+        if (data)
+        {
+            fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", data_size, stream_size);
+        }
+        return -1;
+    }
+    unsigned char *output = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * decoder->height);
+    if (!output)
+    {
+        fprintf(stderr, "Failed to allocate memory for Adam7 decode.\n");
+        return -1;
+    }
+    for (int p = 0; p < 7; p++)
+    {
+        passes[p].data = data + passes[p].offset;
+    }
+
+    // Passes 1-6 and the top half of the rows on the second thread
+    adam7_job_t jobs[2];
+    for (int i = 0; i < 2; i++)
+    {
+        jobs[i].passes = passes;
+        jobs[i].first_pass = i == 0 ? 0 : 6;
+        jobs[i].end_pass = i == 0 ? 6 : 7;
+        jobs[i].bytes_per_pixel = bytes_per_pixel;
+        jobs[i].bit_depth = decoder->bit_depth;
+        jobs[i].output = output;
+        jobs[i].row_size = row_size;
+        jobs[i].first_row = i == 0 ? 0 : decoder->height / 2;
+        jobs[i].end_row = i == 0 ? decoder->height / 2 : decoder->height;
+        jobs[i].status = 0;
+    }
+    int parallel = stream_size >= PNG_ADAM7_PARALLEL_MIN;
+    if (run_adam7_jobs(jobs, unfilter_adam7_passes, parallel) != 0)
+    {
+        return -1;
+    }
+    run_adam7_jobs(jobs, deinterlace_adam7_rows, parallel);
+
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+    for (int p = 0; p < 7; p++)
+    {
+        for (size_t i = 0; i < 5; i++)
+        {
+            decoder->filter_counts[i] += passes[p].filter_counts[i];
+        }
+    }
+    *out_image = output;
+    *out_size = row_size * decoder->height;
+    return 0;
+}
+// jobs[0] on a second thread (if parallel and it starts), jobs[1] on this one; -1 if either failed
+int run_adam7_jobs(adam7_job_t jobs[2], png_thread_fn_t fn, int parallel)
+{
+    png_thread_t thread;
+    int threaded = parallel && png_thread_create(&thread, fn, &jobs[0]) == 0;
+    fn(&jobs[1]);
+    if (threaded)
+    {
+        png_thread_join(thread);
+    }
+    else
+    {
+        fn(&jobs[0]);
+    }
+    return jobs[0].status == 0 && jobs[1].status == 0 ? 0 : -1;
+}
+// Thread function: unfilters passes [first_pass, end_pass) of an adam7_job_t, each over its own filtered rows
+void *unfilter_adam7_passes(void *arg)
+{
+    adam7_job_t *job = (adam7_job_t *)arg;
+    const unfilter_fn_t *kernels = select_filter_kernels(job->bytes_per_pixel);
+    for (size_t p = job->first_pass; p < job->end_pass; p++)
+    {
+        adam7_pass_t *pass = &job->passes[p];
+        if (unfilter_rows(kernels, pass->data, pass->data, job->bytes_per_pixel, pass->row_size, pass->height, pass->filter_counts) != 0)
+        {
+            job->status = -1;
+        }
+    }
+    return NULL;
+}
+// Thread function: builds output rows [first_row, end_row) of an adam7_job_t from the unfiltered passes
+void *deinterlace_adam7_rows(void *arg)
+{
+    adam7_job_t *job = (adam7_job_t *)arg;
+    const adam7_pass_t *passes = job->passes;
+    size_t bytes_per_pixel = job->bytes_per_pixel;
+    for (size_t y = job->first_row; y < job->end_row; y++)
+    {
+        unsigned char *row = job->output + y * job->row_size;
+        if (y & 1)
+        {
+            memcpy(row, passes[6].data + (y >> 1) * passes[6].row_size, passes[6].row_size);
+            continue;
+        }
+        if (job->bit_depth < 8)
+        {
+            // Packed pixels are ORed in bit by bit, the same way for every pass
+            memset(row, 0, job->row_size);
+            for (int p = 0; p < 6; p++)
+            {
+                size_t y_start = adam7_layout[p][1], y_step = adam7_layout[p][3];
+                if (passes[p].width && y >= y_start && (y - y_start) % y_step == 0)
+                {
+                    scatter_packed_pixels(row, passes[p].data + (y - y_start) / y_step * passes[p].row_size, passes[p].width,
+                                          adam7_layout[p][0], adam7_layout[p][2], job->bit_depth);
+                }
+            }
+            continue;
+        }
+        if ((y & 3) == 2)
+        {
+            // Pass 5 has the even pixels of the row, pass 6 the odd ones
+            interleave_pixels(row, passes[4].data + (y >> 2) * passes[4].row_size, passes[4].width,
+                              passes[5].data + (y >> 1) * passes[5].row_size, passes[5].width, bytes_per_pixel);
+            continue;
+        }
+        for (int p = 0; p < 6; p++)
+        {
+            size_t y_start = adam7_layout[p][1], y_step = adam7_layout[p][3];
+            if (passes[p].width && y >= y_start && (y - y_start) % y_step == 0)
+            {
+                scatter_pixels(row, passes[p].data + (y - y_start) / y_step * passes[p].row_size, passes[p].width,
+                               adam7_layout[p][0], adam7_layout[p][2], bytes_per_pixel);
+            }
+        }
+    }
+    return NULL;
+}
+/* Progressive preview: only the first pass_count passes, which sit at the start
+   of the stream, so inflate stops as soon as the last of them is complete; pass 1
+   alone is 1/64 of the pixels. After pass N every pixel on a grid of
+   1 << adam7_preview_shifts[N - 1] is known, so the native preview is that grid, and
+   the upscaled one repeats each grid pixel over its block (nearest neighbour
+   from the upper left), the way browsers paint interlaced images as they load.
+   As with decode_row_range, stopping early leaves the adler32 unchecked, and
+   whole-buffer backends still inflate everything. */
+
+// log2 of the x step and y step of the grid complete after each pass
+static const unsigned char adam7_preview_shifts[7][2] = {{3, 3}, {2, 3}, {2, 2}, {1, 2}, {1, 1}, {0, 1}, {0, 0}};
+
+int decode_adam7_preview(PNG_decoder_t *decoder, int pass_count, int upscale, unsigned char **out_image, size_t *out_size, unsigned int *out_width, unsigned int *out_height)
+{
+    if (decoder->interlace_method != 1)
+    {
+        fprintf(stderr, "Previews need an Adam7 interlaced image.\n");
+        return -1;
+    }
+    if (pass_count < 1 || pass_count > 7)
+    {
+        fprintf(stderr, "Invalid preview pass count: %d (expected 1 to 7)\n", pass_count);
+        return -1;
+    }
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    unsigned int bit_depth = decoder->bit_depth;
+    adam7_pass_t passes[7];
+    size_t stream_size = locate_adam7_passes(decoder, bytes_per_pixel, passes);
+    size_t prefix_size = pass_count < 7 ? passes[pass_count].offset : stream_size;
+
+    // Inflate only the passes asked for
+    unsigned char *data = NULL;
+    if (png_get_inflate_backend()->whole_buffer)
+    {
+        size_t data_size = 0;
+        if (decompress_IDAT(decoder, &data, &data_size) != 0 || data_size != stream_size)
+        {
+            if (data)
+            {
+                fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", data_size, stream_size);
+            }
+            return -1;
+        }
+    }
+    else
+    {
+        data = (unsigned char *)png_arena_alloc(&decoder->arena, prefix_size);
+        inflater_t inflater;
+        if (!data || inflater_init(&inflater, png_get_inflate_backend(), 0, &decoder->arena) != 0)
+        {
+            fprintf(stderr, "Failed to set up preview decode.\n");
+            return -1;
+        }
+        size_t span_index = 0;
+        int ret = inflate_scanline(decoder, &inflater, &span_index, data, prefix_size);
+        if (ret == 0 && pass_count == 7)
+        {
+            ret = finish_IDAT_stream(decoder, &inflater, &span_index);
+        }
+        inflater_end(&inflater);
+        if (ret != 0)
+        {
+            fprintf(stderr, "IDAT data ends before Adam7 pass %d is complete\n", pass_count);
+            return -1;
+        }
+    }
+
+    adam7_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.passes = passes;
+    job.end_pass = (size_t)pass_count;
+    job.bytes_per_pixel = bytes_per_pixel;
+    for (int p = 0; p < pass_count; p++)
+    {
+        passes[p].data = data + passes[p].offset;
+    }
+    unfilter_adam7_passes(&job);
+    if (job.status != 0)
+    {
+        return -1;
+    }
+
+    // Every pass so far lands on the grid: scatter them into the native preview
+    size_t x_shift = adam7_preview_shifts[pass_count - 1][0], y_shift = adam7_preview_shifts[pass_count - 1][1];
+    size_t x_step = (size_t)1 << x_shift, y_step = (size_t)1 << y_shift;
+    size_t preview_width = (decoder->width + x_step - 1) / x_step;
+    size_t preview_height = (decoder->height + y_step - 1) / y_step;
+    size_t preview_row_size = get_packed_row_size(preview_width, bit_depth, bytes_per_pixel);
+    unsigned char *preview = (unsigned char *)png_arena_alloc(&decoder->arena, preview_row_size * preview_height);
+    if (!preview)
+    {
+        fprintf(stderr, "Failed to allocate memory for preview.\n");
+        return -1;
+    }
+    if (bit_depth < 8)
+    {
+        memset(preview, 0, preview_row_size * preview_height); // packed pixels are ORed in
+    }
+    for (int p = 0; p < pass_count; p++)
+    {
+        for (size_t y = 0; y < passes[p].height; y++)
+        {
+            size_t preview_y = (adam7_layout[p][1] + y * adam7_layout[p][3]) >> y_shift;
+            unsigned char *preview_row = preview + preview_y * preview_row_size;
+            const unsigned char *pass_row = passes[p].data + y * passes[p].row_size;
+            if (bit_depth < 8)
+            {
+                scatter_packed_pixels(preview_row, pass_row, passes[p].width, adam7_layout[p][0] >> x_shift, adam7_layout[p][2] >> x_shift, bit_depth);
+            }
+            else
+            {
+                scatter_pixels(preview_row, pass_row, passes[p].width, adam7_layout[p][0] >> x_shift, adam7_layout[p][2] >> x_shift, bytes_per_pixel);
+            }
+        }
+    }
+
+    memset(decoder->filter_counts, 0, sizeof(decoder->filter_counts));
+    for (int p = 0; p < pass_count; p++)
+    {
+        for (size_t i = 0; i < 5; i++)
+        {
+            decoder->filter_counts[i] += passes[p].filter_counts[i];
+        }
+    }
+    if (!upscale)
+    {
+        *out_image = preview;
+        *out_size = preview_row_size * preview_height;
+        *out_width = (unsigned int)preview_width;
+        *out_height = (unsigned int)preview_height;
+        return 0;
+    }
+
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    unsigned char *image = (unsigned char *)png_arena_alloc(&decoder->arena, row_size * decoder->height);
+    if (!image)
+    {
+        fprintf(stderr, "Failed to allocate memory for preview.\n");
+        return -1;
+    }
+    for (size_t y = 0; y < decoder->height; y++)
+    {
+        unsigned char *row = image + y * row_size;
+        if (y & (y_step - 1))
+        {
+            memcpy(row, row - row_size, row_size); // same grid row as the row above
+            continue;
+        }
+        // Pixel k of every block, for each k: a strided copy of the whole preview row
+        const unsigned char *source = preview + (y >> y_shift) * preview_row_size;
+        if (bit_depth < 8)
+        {
+            memset(row, 0, row_size);
+        }
+        for (size_t k = 0; k < x_step && k < decoder->width; k++)
+        {
+            size_t count = (decoder->width - k + x_step - 1) >> x_shift;
+            if (bit_depth < 8)
+            {
+                scatter_packed_pixels(row, source, count, k, x_step, bit_depth);
+            }
+            else
+            {
+                scatter_pixels(row, source, count, k, x_step, bytes_per_pixel);
+            }
+        }
+    }
+    *out_image = image;
+    *out_size = row_size * decoder->height;
+    *out_width = decoder->width;
+    *out_height = decoder->height;
+    return 0;
+}
+// A constant bytes_per_pixel turns the pixel copy into a single load and store
+static PNG_ALWAYS_INLINE void scatter_pixels_body(unsigned char *output, const unsigned char *pixels, size_t count, size_t x_start, size_t x_step, size_t bytes_per_pixel)
+{
+    unsigned char *out = output + x_start * bytes_per_pixel;
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(out + i * x_step * bytes_per_pixel, pixels + i * bytes_per_pixel, bytes_per_pixel);
+    }
+}
+// output[x_start + i * x_step] = pixels[i] for count pixels
+void scatter_pixels(unsigned char *output, const unsigned char *pixels, size_t count, size_t x_start, size_t x_step, size_t bytes_per_pixel)
+{
+    switch (bytes_per_pixel)
+    {
+    case 1:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 1);
+        break;
+    case 2:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 2);
+        break;
+    case 3:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 3);
+        break;
+    case 4:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 4);
+        break;
+    case 6:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 6);
+        break;
+    default:
+        scatter_pixels_body(output, pixels, count, x_start, x_step, 8);
+        break;
+    }
+}
+// scatter_pixels for 1, 2 or 4-bit pixels: ORs each into output, whose bits must be clear
+void scatter_packed_pixels(unsigned char *output, const unsigned char *pixels, size_t count, size_t x_start, size_t x_step, unsigned int bit_depth)
+{
+    unsigned int mask = (1u << bit_depth) - 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t from = i * bit_depth, to = (x_start + i * x_step) * bit_depth;
+        unsigned int sample = (pixels[from >> 3] >> (8 - bit_depth - (from & 7))) & mask;
+        output[to >> 3] |= (unsigned char)(sample << (8 - bit_depth - (to & 7)));
+    }
+}
+// output = even[0], odd[0], even[1], odd[1], ...; even has odd_count or odd_count + 1 pixels
+void interleave_pixels(unsigned char *output, const unsigned char *even, size_t even_count, const unsigned char *odd, size_t odd_count, size_t bytes_per_pixel)
+{
+    size_t i = 0;
+#if PNG_SIMD_X86
+    // 16 bytes of each in, 32 out; bpp 3 and 6 do not fit a lane and stay scalar
+    if (png_get_isa_level() != PNG_ISA_SCALAR && (bytes_per_pixel & (bytes_per_pixel - 1)) == 0)
+    {
+        size_t step = 16 / bytes_per_pixel;
+        for (; i + step <= odd_count; i += step)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(even + i * bytes_per_pixel));
+            __m128i b = _mm_loadu_si128((const __m128i *)(odd + i * bytes_per_pixel));
+            __m128i low, high;
+            switch (bytes_per_pixel)
+            {
+            case 1:
+                low = _mm_unpacklo_epi8(a, b);
+                high = _mm_unpackhi_epi8(a, b);
+                break;
+            case 2:
+                low = _mm_unpacklo_epi16(a, b);
+                high = _mm_unpackhi_epi16(a, b);
+                break;
+            case 4:
+                low = _mm_unpacklo_epi32(a, b);
+                high = _mm_unpackhi_epi32(a, b);
+                break;
+            default:
+                low = _mm_unpacklo_epi64(a, b);
+                high = _mm_unpackhi_epi64(a, b);
+                break;
+            }
+            _mm_storeu_si128((__m128i *)(output + 2 * i * bytes_per_pixel), low);
+            _mm_storeu_si128((__m128i *)(output + 2 * i * bytes_per_pixel + 16), high);
+        }
+    }
+#endif
+    scatter_pixels(output + 2 * i * bytes_per_pixel, even + i * bytes_per_pixel, even_count - i, 0, 2, bytes_per_pixel);
+    scatter_pixels(output + 2 * i * bytes_per_pixel, odd + i * bytes_per_pixel, odd_count - i, 1, 2, bytes_per_pixel);
+}
+#pragma endregion
+#pragma region Threads
+#ifdef _WIN32
+// _beginthreadex wants an unsigned __stdcall entry point
+typedef struct png_thread_start
+{
+    png_thread_fn_t fn;
+    void *arg;
+} png_thread_start_t;
+static unsigned __stdcall png_thread_entry(void *arg)
+{
+    png_thread_start_t start = *(png_thread_start_t *)arg;
+    free(arg);
+    start.fn(start.arg);
+    return 0;
+}
+int png_thread_create(png_thread_t *thread, png_thread_fn_t fn, void *arg)
+{
+    png_thread_start_t *start = (png_thread_start_t *)malloc(sizeof(png_thread_start_t));
+    if (!start)
+    {
+        return -1;
+    }
+    start->fn = fn;
+    start->arg = arg;
+    uintptr_t handle = _beginthreadex(NULL, 0, png_thread_entry, start, 0, NULL);
+    if (handle == 0)
+    {
+        free(start);
+        return -1;
+    }
+    *thread = (HANDLE)handle;
+    return 0;
+}
+void png_thread_join(png_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+void png_mutex_init(png_mutex_t *mutex) { InitializeCriticalSection(mutex); }
+void png_mutex_lock(png_mutex_t *mutex) { EnterCriticalSection(mutex); }
+void png_mutex_unlock(png_mutex_t *mutex) { LeaveCriticalSection(mutex); }
+void png_mutex_destroy(png_mutex_t *mutex) { DeleteCriticalSection(mutex); }
+static BOOL CALLBACK png_once_entry(PINIT_ONCE once, PVOID fn, PVOID *context)
+{
+    (void)once;
+    (void)context;
+    ((void (*)(void))fn)();
+    return TRUE;
+}
+void png_call_once(png_once_t *once, void (*fn)(void)) { InitOnceExecuteOnce(once, png_once_entry, (PVOID)fn, NULL); }
+void png_yield(void) { SwitchToThread(); }
+size_t cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+double now_seconds(void)
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+#else
+int png_thread_create(png_thread_t *thread, png_thread_fn_t fn, void *arg)
+{
+    return pthread_create(thread, NULL, fn, arg) == 0 ? 0 : -1;
+}
+void png_thread_join(png_thread_t thread) { pthread_join(thread, NULL); }
+void png_mutex_init(png_mutex_t *mutex) { pthread_mutex_init(mutex, NULL); }
+void png_mutex_lock(png_mutex_t *mutex) { pthread_mutex_lock(mutex); }
+void png_mutex_unlock(png_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+void png_mutex_destroy(png_mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void png_call_once(png_once_t *once, void (*fn)(void)) { pthread_once(once, fn); }
+void png_yield(void) { sched_yield(); }
+size_t cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+}
+double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+#endif
+#pragma endregion
+#pragma region Arena
+/* One decode used to make a dozen malloc/free pairs (the input copy, the
+   span list, every tEXt string, the inflate state, the inflate and filter
+   buffers), each with its own error path, and in batch mode all worker
+   threads went through the same allocator. Now every per-image allocation
+   comes out of the decoder's arena and everything is released at once by
+   png_arena_free, or by png_arena_reset, which keeps one block for the next
+   image.
+   Requests up to PNG_ARENA_LARGE bytes are bumped out of shared blocks of
+   PNG_ARENA_BLOCK_SIZE; larger ones (images, the zlib window) get a block of
+   their own, which png_arena_realloc can hand to realloc. An arena is not
+   thread-safe: a thread that allocates concurrently needs its own. */
+#define PNG_ARENA_BLOCK_SIZE (64 * 1024)
+#define PNG_ARENA_LARGE (PNG_ARENA_BLOCK_SIZE / 4)
+#define PNG_ARENA_ALIGN 16 // what malloc guarantees, enough for the SSE2 kernels
+// Header size rounded up, so the data after it stays aligned
+#define PNG_ARENA_HEADER ((sizeof(png_arena_block_t) + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1))
+#define PNG_ARENA_DATA(block) ((unsigned char *)(block) + PNG_ARENA_HEADER)
+
+void png_arena_init(png_arena_t *arena)
+{
+    memset(arena, 0, sizeof(*arena));
+}
+void *png_arena_alloc(png_arena_t *arena, size_t size)
+{
+    png_arena_block_t *block;
+    if (size > PNG_ARENA_LARGE)
+    {
+        if (size > SIZE_MAX - PNG_ARENA_HEADER)
+        {
+            return NULL;
+        }
+        block = (png_arena_block_t *)malloc(PNG_ARENA_HEADER + size);
+        if (!block)
+        {
+            return NULL;
+        }
+        block->size = size;
+        block->used = size;
+        block->next = arena->large;
+        arena->large = block;
+        arena->large_count++;
+        return PNG_ARENA_DATA(block);
+    }
+
+    block = arena->blocks;
+    size_t offset = block ? (block->used + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1) : 0;
+    if (!block || offset + size > block->size)
+    {
+        block = (png_arena_block_t *)malloc(PNG_ARENA_HEADER + PNG_ARENA_BLOCK_SIZE);
+        if (!block)
+        {
+            return NULL;
+        }
+        block->size = PNG_ARENA_BLOCK_SIZE;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        offset = 0;
+    }
+    block->used = offset + size;
+    arena->last = PNG_ARENA_DATA(block) + offset;
+    return arena->last;
+}
+/* Resizes ptr (old_size bytes, NULL for none) to new_size bytes. Large
+   allocations, the most recent small one and shrinking small ones are resized
+   in place, anything else is copied into a new allocation and the old bytes stay unused until
+   the arena is released. NULL if out of memory; ptr is then still valid. */
+void *png_arena_realloc(png_arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+    {
+        return png_arena_alloc(arena, new_size);
+    }
+    if (old_size > PNG_ARENA_LARGE)
+    {
+        for (png_arena_block_t **link = &arena->large; *link; link = &(*link)->next)
+        {
+            if (PNG_ARENA_DATA(*link) == ptr)
+            {
+                if (new_size > SIZE_MAX - PNG_ARENA_HEADER)
+                {
+                    return NULL;
+                }
+                png_arena_block_t *resized = (png_arena_block_t *)realloc(*link, PNG_ARENA_HEADER + new_size);
+                if (!resized)
+                {
+                    return NULL;
+                }
+                resized->size = new_size;
+                resized->used = new_size;
+                *link = resized;
+                return PNG_ARENA_DATA(resized);
+            }
+        }
+    }
+    else if (new_size <= old_size)
+    {
+        return ptr; // a small allocation just keeps its tail
+    }
+    else if (ptr == arena->last && new_size <= PNG_ARENA_LARGE)
+    {
+        png_arena_block_t *block = arena->blocks;
+        size_t offset = (size_t)((unsigned char *)ptr - PNG_ARENA_DATA(block));
+        if (offset + new_size <= block->size)
+        {
+            block->used = offset + new_size;
+            return ptr;
+        }
+    }
+
+    void *moved = png_arena_alloc(arena, new_size);
+    if (moved)
+    {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return moved;
+}
+png_arena_mark_t png_arena_mark(png_arena_t *arena)
+{
+    png_arena_mark_t mark;
+    mark.block = arena->blocks;
+    mark.used = arena->blocks ? arena->blocks->used : 0;
+    mark.large_count = arena->large_count;
+    return mark;
+}
+// Frees everything allocated after mark was taken
+void png_arena_release(png_arena_t *arena, png_arena_mark_t mark)
+{
+    while (arena->large_count > mark.large_count)
+    {
+        png_arena_block_t *block = arena->large;
+        arena->large = block->next;
+        arena->large_count--;
+        free(block);
+    }
+    while (arena->blocks != mark.block)
+    {
+        png_arena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    if (arena->blocks)
+    {
+        arena->blocks->used = mark.used;
+    }
+    arena->last = NULL;
+}
+// Frees everything but the current shared block, which is emptied for reuse
+void png_arena_reset(png_arena_t *arena)
+{
+    png_arena_block_t *keep = arena->blocks;
+    if (keep)
+    {
+        arena->blocks = keep->next;
+        keep->next = NULL;
+    }
+    png_arena_mark_t empty = {NULL, 0, 0};
+    png_arena_release(arena, empty);
+    if (keep)
+    {
+        keep->used = 0;
+        arena->blocks = keep;
+    }
+}
+void png_arena_free(png_arena_t *arena)
+{
+    png_arena_mark_t empty = {NULL, 0, 0};
+    png_arena_release(arena, empty);
+}
+// zalloc/zfree for zlib and zlib-ng, opaque being the arena: nothing is freed
+// before the arena is, and inflate only frees at inflateEnd
+void *png_arena_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+    return png_arena_alloc((png_arena_t *)opaque, (size_t)items * size);
+}
+void png_arena_zfree(void *opaque, void *address)
+{
+    (void)opaque;
+    (void)address;
+}
+#pragma endregion
+#pragma region Decoder context
+/* For many small images in a row, setting up and tearing down the inflate
+   state and the buffers costs about as much as the decode itself. A
+   PNG_decoder_context_t keeps them between images: the inflate state is
+   reset instead of created again (zlib keeps its window allocation, in the
+   context's own arena), the output and scanline buffers only grow when a
+   larger image comes along. Per image, the input is released and the
+   decoder's arena emptied, keeping its first block for the next span list
+   and texts. */
+void png_decoder_context_init(PNG_decoder_context_t *context)
+{
+    memset(context, 0, sizeof(*context));
+}
+// Releases the current image's input and arena allocations; buffers and the inflate state stay for the next image
+void png_decoder_reset(PNG_decoder_context_t *context)
+{
+    PNG_decoder_t *decoder = &context->decoder;
+    release_input(decoder);
+    png_arena_reset(&decoder->arena);
+    decoder->texts = NULL;
+    decoder->text_count = 0;
+    decoder->idat_spans = NULL;
+    decoder->idat_capacity = 0;
+    decoder->idat_count = 0;
+    decoder->idat_size = 0;
+}
+void png_decoder_context_free(PNG_decoder_context_t *context)
+{
+    png_decoder_reset(context);
+    inflater_end(&context->inflater);
+    png_arena_free(&context->decoder.arena);
+    png_arena_free(&context->arena);
+    free(context->image);
+    free(context->scanline);
+    png_decoder_context_init(context);
+}
+// Grows *buffer to at least size bytes, keeping it if it is already big enough
+int reserve_buffer(unsigned char **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+    {
+        return 0;
+    }
+    unsigned char *grown = (unsigned char *)realloc(*buffer, size);
+    if (!grown)
+    {
+        fprintf(stderr, "Failed to allocate memory for image data.\n");
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = size;
+    return 0;
+}
+/* Decodes filename with the context's buffers. *out_image points into the
+   context and stays valid until the next decode or png_decoder_context_free;
+   context->decoder describes the image (size, color type, texts) until then. */
+int png_decoder_decode_next(PNG_decoder_context_t *context, const char *filename, const unsigned char **out_image, size_t *out_size)
+{
+    PNG_decoder_t *decoder = &context->decoder;
+    png_decoder_reset(context);
+
+    if (initialize_decoder(decoder, filename) != 0) // keeps the emptied arena
+    {
+        return -1;
+    }
+    parse_chunks(decoder);
+
+    if (decoder->crc_failed || decoder->ihdr_invalid)
+    {
+        return -1;
+    }
+    if (decoder->width == 0 || decoder->height == 0)
+    {
+        fprintf(stderr, "%s: missing or empty IHDR\n", filename);
+        return -1;
+    }
+    size_t bytes_per_pixel = get_bytes_per_pixel(decoder);
+    if (bytes_per_pixel == 0)
+    {
+        return -1;
+    }
+    size_t row_size = get_row_size(decoder, bytes_per_pixel);
+    size_t scanline_size = row_size + 1; // + 1: filter byte
+
+    // The inflate state is reused as long as the backend stays the same
+    const inflate_backend_t *backend = png_get_inflate_backend();
+    if (context->inflater.state && context->inflater.backend != backend)
+    {
+        inflater_end(&context->inflater);
+        png_arena_reset(&context->arena);
+    }
+    if (!context->inflater.state)
+    {
+        if (inflater_init(&context->inflater, backend, 0, &context->arena) != 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (backend->reset(context->inflater.state) != 0)
+        {
+            fprintf(stderr, "Failed to reset %s.\n", backend->name);
+            inflater_end(&context->inflater);
+            return -1;
+        }
+        memset(&context->inflater.io, 0, sizeof(context->inflater.io));
+        context->inflater.status = INFLATE_MORE;
+    }
+
+    IDAT_crc_check_t crc_check;
+    unsigned char *image = NULL;
+    size_t image_size = row_size * decoder->height;
+    int ret = -1;
+    if (IDAT_crc_begin(decoder, &crc_check) != 0)
+    {
+        goto done;
+    }
+    if (decoder->interlace_method == 1)
+    {
+        // The passes are inflated and unfiltered in the decoder's arena, not the context's buffers
+        if (decode_interlaced(decoder, &image, &image_size) != 0)
+        {
+            goto done;
+        }
+    }
+    else if (backend->whole_buffer)
+    {
+        // Inflate everything into the image buffer, then unfilter over it
+        size_t stream_size = scanline_size * decoder->height;
+        size_t produced = 0;
+        if (reserve_buffer(&context->image, &context->image_capacity, stream_size) != 0 ||
+            inflate_IDAT(decoder, &context->inflater, context->image, stream_size, &produced) != 0)
+        {
+            goto done;
+        }
+        if (produced != stream_size)
+        {
+            fprintf(stderr, "IDAT data holds %zu of %zu bytes\n", produced, stream_size);
+            goto done;
+        }
+        if (unfilter_image(decoder, context->image, context->image, bytes_per_pixel) != 0)
+        {
+            goto done;
+        }
+    }
+    else
+    {
+        if (reserve_buffer(&context->image, &context->image_capacity, row_size * decoder->height) != 0 ||
+            reserve_buffer(&context->scanline, &context->scanline_capacity, scanline_size) != 0 ||
+            inflate_and_unfilter(decoder, &context->inflater, context->image, context->scanline) != 0)
+        {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    if (IDAT_crc_end(&crc_check) != 0 || ret != 0)
+    {
+        return -1;
+    }
+    *out_image = image ? image : context->image;
+    *out_size = image_size;
+    return 0;
+}
+#pragma endregion
+#pragma region Batch
+/* Batch mode decodes many files in one process, so the per-image cost is the
+   decode itself instead of process startup, DLL loading and zlib setup.
+   Each worker thread owns a PNG_decoder_context_t, so its buffers and
+   inflate state carry over from one file to the next.
+
+   Batches mix icons with huge tiles, and one image's inflate and unfilter
+   are serial (every row depends on the one before it), so the schedule is
+   what decides the wall time: if a giant image is picked up last, every
+   other core idles while it decodes. Each file's cost is estimated from its
+   IHDR before anything is decoded, the files are sorted largest first and
+   dealt round-robin into one deque per worker. A worker takes from the
+   front of its own deque and, once that is empty, steals the largest task
+   still waiting in any other deque, so the small files fill the gaps at the
+   end instead of a big one. */
+// Reads only the signature and IHDR (png_probe). Truncated or non-PNG files cost 0: they fail fast.
+uint64_t estimate_decode_cost(const char *path)
+{
+    PNG_info_t info;
+    if (png_probe(path, &info) != 0)
+    {
+        return 0;
+    }
+
+    // Channels per color type: gray, -, RGB, palette index, gray+alpha, -, RGBA
+    static const unsigned char channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    uint64_t row_bytes = ((uint64_t)info.width * channels[info.color_type] * info.bit_depth + 7) / 8;
+    return (row_bytes + 1) * info.height; // + 1: filter byte
+}
+int compare_task_cost(const void *a, const void *b)
+{
+    uint64_t cost_a = ((const batch_task_t *)a)->cost;
+    uint64_t cost_b = ((const batch_task_t *)b)->cost;
+    return (cost_a < cost_b) - (cost_a > cost_b); // descending
+}
+// Own deque first, then the largest task waiting anywhere else; 0 once everything is taken
+int batch_next_task(batch_job_t *job, size_t index, batch_task_t *task)
+{
+    batch_deque_t *own = &job->deques[index];
+    png_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+    {
+        *task = own->tasks[own->head++];
+        png_mutex_unlock(&own->lock);
+        return 1;
+    }
+    png_mutex_unlock(&own->lock);
+
+    // No task is ever added after the start, so a scan that comes back empty means done
+    for (;;)
+    {
+        batch_deque_t *victim = NULL;
+        uint64_t victim_cost = 0;
+        for (size_t i = 1; i < job->worker_count; i++)
+        {
+            batch_deque_t *deque = &job->deques[(index + i) % job->worker_count];
+            png_mutex_lock(&deque->lock);
+            if (deque->head < deque->tail && (!victim || deque->tasks[deque->head].cost > victim_cost))
+            {
+                victim = deque;
+                victim_cost = deque->tasks[deque->head].cost;
+            }
+            png_mutex_unlock(&deque->lock);
+        }
+        if (!victim)
+        {
+            return 0;
+        }
+
+        png_mutex_lock(&victim->lock);
+        int stolen = victim->head < victim->tail;
+        if (stolen)
+        {
+            *task = victim->tasks[victim->head++];
+        }
+        png_mutex_unlock(&victim->lock);
+        if (stolen)
+        {
+            return 1;
+        }
+        // Lost the race for it, look again
+    }
+}
+
+// Decodes one file the way the single-file path does, without printing the info blocks
+int decode_file(PNG_decoder_context_t *context, const char *path, size_t *input_size, size_t *output_size, unsigned int *width, unsigned int *height)
+{
+    const unsigned char *image;
+    if (png_decoder_decode_next(context, path, &image, output_size) != 0)
+    {
+        return -1;
+    }
+    *input_size = context->decoder.data_size;
+    *width = context->decoder.width;
+    *height = context->decoder.height;
+    return 0;
+}
+void *batch_worker(void *arg)
+{
+    batch_job_t *job = ((batch_worker_arg_t *)arg)->job;
+    size_t index = ((batch_worker_arg_t *)arg)->index;
+
+    // One context per worker: its buffers and inflate state are reused for every file it decodes
+    PNG_decoder_context_t context;
+    png_decoder_context_init(&context);
+
+    batch_task_t task;
+    while (batch_next_task(job, index, &task))
+    {
+        const char *path = task.path;
+        size_t input_size = 0, output_size = 0;
+        unsigned int width = 0, height = 0;
+        double start = now_seconds();
+        int ret = decode_file(&context, path, &input_size, &output_size, &width, &height);
+        double elapsed = now_seconds() - start;
+
+        png_mutex_lock(&job->lock);
+        if (ret == 0)
+        {
+            printf("OK   %s %ux%u %.2f ms\n", path, width, height, elapsed * 1000.0);
+            job->files_ok++;
+            job->input_bytes += input_size;
+            job->output_bytes += output_size;
+        }
+        else
+        {
+            printf("FAIL %s\n", path);
+            job->files_failed++;
+        }
+        png_mutex_unlock(&job->lock);
+    }
+    png_decoder_context_free(&context);
+    return NULL;
+}
+// One path per line; empty lines are skipped. "-" reads the list from stdin.
+int read_path_list(const char *list_name, char ***paths, size_t *path_count, size_t *path_capacity)
+{
+    FILE *list = strcmp(list_name, "-") == 0 ? stdin : fopen(list_name, "r");
+    if (!list)
+    {
+        perror("Failed to open file list");
+        return -1;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), list))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        if (add_path(paths, path_count, path_capacity, line) != 0)
+        {
+            if (list != stdin)
+            {
+                fclose(list);
+            }
+            return -1;
+        }
+    }
+
+    if (list != stdin)
+    {
+        fclose(list);
+    }
+    return 0;
+}
+int add_path(char ***paths, size_t *path_count, size_t *path_capacity, const char *path)
+{
+    if (*path_count == *path_capacity)
+    {
+        size_t new_capacity = *path_capacity ? *path_capacity * 2 : 64;
+        char **grown = (char **)realloc(*paths, new_capacity * sizeof(char *));
+        if (!grown)
+        {
+            fprintf(stderr, "Failed to allocate memory for file list.\n");
+            return -1;
+        }
+        *paths = grown;
+        *path_capacity = new_capacity;
+    }
+
+    size_t length = strlen(path);
+    char *copy = (char *)malloc(length + 1);
+    if (!copy)
+    {
+        fprintf(stderr, "Failed to allocate memory for file list.\n");
+        return -1;
+    }
+    memcpy(copy, path, length + 1);
+    (*paths)[(*path_count)++] = copy;
+    return 0;
+}
+int run_batch(char **paths, size_t path_count, size_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = cpu_count();
+    }
+    if (thread_count > path_count)
+    {
+        thread_count = path_count ? path_count : 1;
+    }
+
+    batch_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.worker_count = thread_count;
+    batch_task_t *sorted = (batch_task_t *)malloc(path_count * sizeof(batch_task_t));
+    job.tasks = (batch_task_t *)malloc(path_count * sizeof(batch_task_t));
+    job.deques = (batch_deque_t *)calloc(thread_count, sizeof(batch_deque_t));
+    batch_worker_arg_t *args = (batch_worker_arg_t *)malloc(thread_count * sizeof(batch_worker_arg_t));
+    png_thread_t *threads = (png_thread_t *)malloc(thread_count * sizeof(png_thread_t));
+    if (!sorted || !job.tasks || !job.deques || !args || !threads)
+    {
+        fprintf(stderr, "Failed to allocate memory for worker threads.\n");
+        free(sorted);
+        free(job.tasks);
+        free(job.deques);
+        free(args);
+        free(threads);
+        return -1;
+    }
+
+    double start = now_seconds(); // the IHDR probes are part of the batch's cost
+
+    // Largest first, then dealt round-robin: worker w gets tasks w, w + n, w + 2n, ...
+    for (size_t i = 0; i < path_count; i++)
+    {
+        sorted[i].path = paths[i];
+        sorted[i].cost = estimate_decode_cost(paths[i]);
+    }
+    qsort(sorted, path_count, sizeof(batch_task_t), compare_task_cost);
+
+    size_t next = 0;
+    for (size_t w = 0; w < thread_count; w++)
+    {
+        batch_deque_t *deque = &job.deques[w];
+        deque->tasks = job.tasks + next;
+        for (size_t i = w; i < path_count; i += thread_count)
+        {
+            job.tasks[next++] = sorted[i];
+        }
+        deque->head = 0;
+        deque->tail = (size_t)(job.tasks + next - deque->tasks);
+        png_mutex_init(&deque->lock);
+
+        args[w].job = &job;
+        args[w].index = w;
+    }
+    free(sorted);
+    png_mutex_init(&job.lock);
+
+    size_t started = 0;
+    for (; started < thread_count; started++)
+    {
+        if (png_thread_create(&threads[started], batch_worker, &args[started]) != 0)
+        {
+            fprintf(stderr, "Failed to start worker thread %zu.\n", started);
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        batch_worker(&args[0]); // no threads at all: decode on this one, stealing everything
+    }
+    for (size_t i = 0; i < started; i++)
+    {
+        png_thread_join(threads[i]);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("\nBatch: %zu files, %zu ok, %zu failed, %zu threads, %.3f s\n",
+           path_count, job.files_ok, job.files_failed, started ? started : 1, elapsed);
+    if (elapsed > 0)
+    {
+        printf("Throughput: %.1f files/s, %.1f MB/s compressed in, %.1f MB/s pixels out\n",
+               job.files_ok / elapsed, job.input_bytes / elapsed / 1e6, job.output_bytes / elapsed / 1e6);
+    }
+
+    for (size_t w = 0; w < thread_count; w++)
+    {
+        png_mutex_destroy(&job.deques[w].lock);
+    }
+    png_mutex_destroy(&job.lock);
+    free(job.tasks);
+    free(job.deques);
+    free(args);
+    free(threads);
+    return job.files_failed ? -1 : 0;
+}
+#pragma endregion
+#pragma region Utilities
+void print_filter_counts(size_t filter_counts[5])
+{
+    printf("Filter Counts:\n");
+    for (size_t i = 0; i < 5; i++)
+    {
+        printf("Filter %zu: %zu times\n", i, filter_counts[i]);
     }
-
-    return output;
 }
-#pragma endregion
-#pragma region Utilities
 /* __builtin_bswap32 is highly optimized and translates directly to
      architecture-specific assembly instructions.
      For example, on x86, it compiles to a single BSWAP instruction.